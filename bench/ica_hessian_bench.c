@@ -0,0 +1,156 @@
+/**
+ * @file ica_hessian_bench.c
+ * @brief Checks and times the integral-image ICA Hessians against compute_hessian
+ *
+ * Built by `make bench`. For tiles of 8, 16 and 32 pixels on a frame-sized
+ * random plane, builds the per-tile Hessians with compute_hessian and from
+ * summed-area tables, checks that they agree and that refine_alignment_ica
+ * gives the same flow with either, and that it rejects an overlapping layout.
+ * Exits non-zero if any check fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include "ica.h"
+
+#define BENCH_WIDTH 640
+#define BENCH_HEIGHT 480
+#define BENCH_MIN_SECONDS 0.1
+
+static const int TILE_SIZES[] = {8, 16, 32};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Float patch sums against double table differences; relative to the patch
+static bool hessians_match(const HessianMatrix* a, const HessianMatrix* b) {
+    if (a->height != b->height || a->width != b->width) return false;
+    for (int p = 0; p < a->height * a->width; p++) {
+        const float* ha = &a->data[p * 4];
+        const float* hb = &b->data[p * 4];
+        float scale = fabsf(ha[0]) + fabsf(ha[3]) + 1e-6f;
+        for (int k = 0; k < 4; k++) {
+            if (fabsf(ha[k] - hb[k]) > 1e-4f * scale) return false;
+        }
+    }
+    return true;
+}
+
+static bool flows_match(const AlignmentMap* a, const AlignmentMap* b) {
+    if (!a || !b) return false;
+    for (int i = 0; i < a->height * a->width; i++) {
+        if (fabsf(a->data[i].x - b->data[i].x) > 1e-3f || fabsf(a->data[i].y - b->data[i].y) > 1e-3f) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Milliseconds per call of one Hessian build, repeated for BENCH_MIN_SECONDS
+static double time_dense(const ImageGradients* grads, int tile) {
+    long calls = 0;
+    double start = now_seconds();
+    double elapsed;
+    do {
+        free_hessian_matrix(compute_hessian(grads, tile));
+        calls++;
+        elapsed = now_seconds() - start;
+    } while (elapsed < BENCH_MIN_SECONDS);
+    return elapsed * 1e3 / calls;
+}
+
+static double time_integral(const ImageGradients* grads, int tile) {
+    long calls = 0;
+    double start = now_seconds();
+    double elapsed;
+    do {
+        HessianIntegral* integral = init_hessian_integral(grads);
+        free_hessian_matrix(compute_hessian_integral(integral, tile, tile));
+        free_hessian_integral(integral);
+        calls++;
+        elapsed = now_seconds() - start;
+    } while (elapsed < BENCH_MIN_SECONDS);
+    return elapsed * 1e3 / calls;
+}
+
+int main(void) {
+    Image* ref = create_image(BENCH_HEIGHT, BENCH_WIDTH, 1);
+    Image* alt = create_image(BENCH_HEIGHT, BENCH_WIDTH, 1);
+    if (!ref || !alt) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    // Smooth texture so ICA converges, shifted by a sub-pixel step in alt
+    srand(1);
+    float phase = (float)rand() / RAND_MAX;
+    for (int y = 0; y < BENCH_HEIGHT; y++) {
+        for (int x = 0; x < BENCH_WIDTH; x++) {
+            ref->data[(size_t)y * ref->pitch + x] = 0.5f + 0.25f * sinf(0.21f * x + phase) * cosf(0.17f * y);
+            alt->data[(size_t)y * alt->pitch + x] =
+                0.5f + 0.25f * sinf(0.21f * (x + 0.4f) + phase) * cosf(0.17f * (y - 0.3f));
+        }
+    }
+
+    ICAParams params = {.sigma_blur = 0, .num_iterations = 3};
+    ImageGradients* grads = init_ica(ref, &params);
+    HessianIntegral* integral = grads ? init_hessian_integral(grads) : NULL;
+    if (!grads || !integral) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    bool all_ok = true;
+    printf("%dx%d plane\n\n", BENCH_WIDTH, BENCH_HEIGHT);
+    printf("%5s %12s %12s  %-8s %-8s %-8s\n", "tile", "dense ms", "integral ms", "hessian", "flow", "overlap");
+
+    for (size_t t = 0; t < sizeof(TILE_SIZES) / sizeof(TILE_SIZES[0]); t++) {
+        int tile = TILE_SIZES[t];
+        params.tile_size = tile;
+
+        HessianMatrix* dense = compute_hessian(grads, tile);
+        HessianMatrix* tiled = compute_hessian_integral(integral, tile, tile);
+        HessianMatrix* overlapped = compute_hessian_integral(integral, tile, tile / 2);
+        AlignmentMap* initial = create_alignment_map(BENCH_HEIGHT / tile, BENCH_WIDTH / tile);
+        if (!dense || !tiled || !overlapped || !initial) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        for (int i = 0; i < initial->height * initial->width; i++) {
+            initial->data[i].x = 0;
+            initial->data[i].y = 0;
+        }
+
+        bool hessian_ok = hessians_match(dense, tiled);
+        AlignmentMap* flow_dense = refine_alignment_ica(ref, alt, grads, dense, initial, &params);
+        AlignmentMap* flow_tiled = refine_alignment_ica(ref, alt, grads, tiled, initial, &params);
+        bool flow_ok = flows_match(flow_dense, flow_tiled);
+        // Patches every tile / 2 pixels do not line up with the alignment tiles
+        AlignmentMap* flow_overlapped = refine_alignment_ica(ref, alt, grads, overlapped, initial, &params);
+        bool overlap_ok = flow_overlapped == NULL;
+
+        printf("%5d %12.3f %12.3f  %-8s %-8s %-8s\n", tile, time_dense(grads, tile), time_integral(grads, tile),
+               hessian_ok ? "ok" : "MISMATCH", flow_ok ? "ok" : "MISMATCH", overlap_ok ? "rejected" : "ACCEPTED");
+        all_ok &= hessian_ok && flow_ok && overlap_ok;
+
+        free_alignment_map(flow_overlapped);
+        free_alignment_map(flow_tiled);
+        free_alignment_map(flow_dense);
+        free_alignment_map(initial);
+        free_hessian_matrix(overlapped);
+        free_hessian_matrix(tiled);
+        free_hessian_matrix(dense);
+    }
+
+    free_hessian_integral(integral);
+    free_image_gradients(grads);
+    free_image(alt);
+    free_image(ref);
+    return all_ok ? 0 : 1;
+}
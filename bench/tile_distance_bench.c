@@ -0,0 +1,193 @@
+/**
+ * @file tile_distance_bench.c
+ * @brief Microbenchmark of the SAD/SSD tile distance kernels against scalar
+ *
+ * Built by `make bench`. For tiles of 8, 16 and 32 pixels with 1 and 3
+ * interleaved channels, times every kernel the running CPU supports on
+ * candidates spread over a frame-sized image, as local_search sees them, and
+ * checks each result against the scalar kernel. Exits non-zero on a mismatch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <float.h>
+#include <math.h>
+#include <time.h>
+#include "tile_distance.h"
+
+#define BENCH_WIDTH 640
+#define BENCH_HEIGHT 480
+#define BENCH_CANDIDATES 4096
+#define BENCH_MIN_SECONDS 0.1
+
+static const int TILE_SIZES[] = {8, 16, 32};
+static const int CHANNEL_COUNTS[] = {1, 3};
+static const SimdLevel LEVELS[] = {SIMD_LEVEL_SCALAR, SIMD_LEVEL_SSE, SIMD_LEVEL_AVX2, SIMD_LEVEL_AVX512};
+static const PixelFormat PACKED_FORMATS[] = {PIXEL_FORMAT_U8, PIXEL_FORMAT_U16};
+
+typedef struct {
+    const void* ref;        // Reference tile
+    const void* alt;        // Sample (0, 0) of the alternate image
+    int stride;             // Both, in samples
+    int sample_size;
+    const int* offsets;     // Alternate tile starts, in samples
+    int row_len;
+    int rows;
+} BenchInput;
+
+// A float kernel, or a packed one when that is set instead
+typedef struct {
+    TileDistanceFn float_kernel;
+    PackedTileDistanceFn packed_kernel;
+} BenchKernel;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Sum of full distances over every candidate, so the calls cannot be elided
+static double run_candidates(BenchKernel kernel, const BenchInput* in) {
+    double sum = 0;
+    int rows_done;
+    if (kernel.float_kernel) {
+        const float* alt = (const float*)in->alt;
+        for (int i = 0; i < BENCH_CANDIDATES; i++) {
+            sum += kernel.float_kernel((const float*)in->ref, in->stride, alt + in->offsets[i], in->stride,
+                                       in->row_len, in->rows, FLT_MAX, &rows_done);
+        }
+    } else {
+        const char* alt = (const char*)in->alt;
+        for (int i = 0; i < BENCH_CANDIDATES; i++) {
+            sum += kernel.packed_kernel(in->ref, in->stride, alt + (size_t)in->offsets[i] * in->sample_size,
+                                        in->stride, in->row_len, in->rows, FLT_MAX, &rows_done);
+        }
+    }
+    return sum;
+}
+
+// Nanoseconds per candidate, repeating the sweep for at least BENCH_MIN_SECONDS
+static double time_kernel(BenchKernel kernel, const BenchInput* in, double* checksum) {
+    *checksum = run_candidates(kernel, in);  // Warm up
+    long sweeps = 0;
+    double start = now_seconds();
+    double elapsed;
+    do {
+        *checksum = run_candidates(kernel, in);
+        sweeps++;
+        elapsed = now_seconds() - start;
+    } while (elapsed < BENCH_MIN_SECONDS);
+    return elapsed * 1e9 / ((double)sweeps * BENCH_CANDIDATES);
+}
+
+// Prints one kernel's row; returns false if its distances disagree with scalar
+static bool report(const char* format, const char* metric, int tile, int channels, SimdLevel level,
+                   double ns, double scalar_ns, double checksum, double scalar_checksum) {
+    // Float kernels sum in a different order from scalar; integer ones must match
+    bool match = fabs(checksum - scalar_checksum) <= 1e-4 * fabs(scalar_checksum) + 1e-3;
+    printf("%-6s %-4s %5d %8d  %-7s %9.1f %8.2fx  %s\n", format, metric, tile, channels,
+           simd_level_name(level), ns, scalar_ns / ns, match ? "ok" : "MISMATCH");
+    return match;
+}
+
+int main(void) {
+    SimdLevel best = detect_simd_level();
+    bool all_match = true;
+    int stride = BENCH_WIDTH * 3;
+    size_t samples = (size_t)BENCH_HEIGHT * stride;
+    float* ref_f = (float*)malloc(sizeof(float) * samples);
+    float* alt_f = (float*)malloc(sizeof(float) * samples);
+    uint8_t* ref_u8 = (uint8_t*)malloc(samples);
+    uint8_t* alt_u8 = (uint8_t*)malloc(samples);
+    uint16_t* ref_u16 = (uint16_t*)malloc(sizeof(uint16_t) * samples);
+    uint16_t* alt_u16 = (uint16_t*)malloc(sizeof(uint16_t) * samples);
+    int* offsets = (int*)malloc(sizeof(int) * BENCH_CANDIDATES);
+    if (!ref_f || !alt_f || !ref_u8 || !alt_u8 || !ref_u16 || !alt_u16 || !offsets) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    srand(1);
+    for (size_t i = 0; i < samples; i++) {
+        ref_f[i] = (float)rand() / RAND_MAX;
+        alt_f[i] = (float)rand() / RAND_MAX;
+        ref_u8[i] = (uint8_t)(ref_f[i] * 255.0f + 0.5f);
+        alt_u8[i] = (uint8_t)(alt_f[i] * 255.0f + 0.5f);
+        ref_u16[i] = (uint16_t)(ref_f[i] * 65535.0f + 0.5f);
+        alt_u16[i] = (uint16_t)(alt_f[i] * 65535.0f + 0.5f);
+    }
+
+    printf("Best instruction set: %s; %dx%d image, %d candidates per sweep\n\n",
+           simd_level_name(best), BENCH_WIDTH, BENCH_HEIGHT, BENCH_CANDIDATES);
+    printf("%-6s %-4s %5s %8s  %-7s %9s %9s\n", "format", "dist", "tile", "channels", "kernel",
+           "ns/tile", "vs scalar");
+
+    for (size_t t = 0; t < sizeof(TILE_SIZES) / sizeof(TILE_SIZES[0]); t++) {
+        for (size_t c = 0; c < sizeof(CHANNEL_COUNTS) / sizeof(CHANNEL_COUNTS[0]); c++) {
+            int tile = TILE_SIZES[t];
+            int channels = CHANNEL_COUNTS[c];
+            int row_len = tile * channels;
+
+            // Candidates anywhere a whole tile fits, one image row of samples per row
+            for (int i = 0; i < BENCH_CANDIDATES; i++) {
+                int x = rand() % (BENCH_WIDTH - tile + 1);
+                int y = rand() % (BENCH_HEIGHT - tile + 1);
+                offsets[i] = y * stride + x * channels;
+            }
+
+            for (int metric = 0; metric <= 1; metric++) {
+                const char* metric_name = metric == 0 ? "sad" : "ssd";
+
+                BenchInput in = {ref_f, alt_f, stride, sizeof(float), offsets, row_len, tile};
+                double scalar_checksum = 0;
+                double scalar_ns = 0;
+                for (size_t l = 0; l < sizeof(LEVELS) / sizeof(LEVELS[0]) && LEVELS[l] <= best; l++) {
+                    BenchKernel kernel = {select_tile_distance(metric, row_len, LEVELS[l]), NULL};
+                    double checksum;
+                    double ns = time_kernel(kernel, &in, &checksum);
+                    if (LEVELS[l] == SIMD_LEVEL_SCALAR) {
+                        scalar_ns = ns;
+                        scalar_checksum = checksum;
+                    }
+                    all_match &= report("float", metric_name, tile, channels, LEVELS[l], ns, scalar_ns,
+                                        checksum, scalar_checksum);
+                }
+
+                for (size_t f = 0; f < sizeof(PACKED_FORMATS) / sizeof(PACKED_FORMATS[0]); f++) {
+                    bool u8 = PACKED_FORMATS[f] == PIXEL_FORMAT_U8;
+                    BenchInput packed = {u8 ? (const void*)ref_u8 : (const void*)ref_u16,
+                                         u8 ? (const void*)alt_u8 : (const void*)alt_u16,
+                                         stride, u8 ? 1 : 2, offsets, row_len, tile};
+                    // Levels that pick the same kernel as the one below are skipped
+                    PackedTileDistanceFn previous = NULL;
+                    for (size_t l = 0; l < sizeof(LEVELS) / sizeof(LEVELS[0]) && LEVELS[l] <= best; l++) {
+                        BenchKernel kernel = {NULL, select_packed_tile_distance(PACKED_FORMATS[f], metric,
+                                                                                row_len, LEVELS[l])};
+                        if (kernel.packed_kernel == previous) continue;
+                        previous = kernel.packed_kernel;
+                        double checksum;
+                        double ns = time_kernel(kernel, &packed, &checksum);
+                        if (LEVELS[l] == SIMD_LEVEL_SCALAR) {
+                            scalar_ns = ns;
+                            scalar_checksum = checksum;
+                        }
+                        all_match &= report(u8 ? "u8" : "u16", metric_name, tile, channels, LEVELS[l], ns,
+                                            scalar_ns, checksum, scalar_checksum);
+                    }
+                }
+            }
+        }
+    }
+
+    free(offsets);
+    free(alt_u16);
+    free(ref_u16);
+    free(alt_u8);
+    free(ref_u8);
+    free(alt_f);
+    free(ref_f);
+    return all_match ? 0 : 1;
+}
@@ -4,18 +4,42 @@
 #include <float.h>
 #include <stdio.h>
 #include "block_matching.h"
+#include "tile_distance.h"
+#include "profiler.h"
+#include "frame_pool.h"
 
 // Helper function declarations
-static Image* downsample_image(const Image* img, int factor);
+static Image* downsample_image(const Image* img, int factor, ThreadPool* pool, FrameArena* arena);
 static AlignmentMap* align_on_level(const Image* ref_level, const Image* alt_level, 
+                                  const PackedImage* ref_packed, const PackedImage* alt_packed,
                                   const BlockMatchingParams* params, int level_idx,
-                                  const AlignmentMap* prev_alignments);
+                                  const AlignmentMap* prev_alignments, const AlignmentPrior* prior);
 static AlignmentMap* upsample_alignments(const Image* ref_level, const Image* alt_level,
                                        const AlignmentMap* prev_alignments,
-                                       int upsampling_factor, int tile_size, int prev_tile_size);
-static void local_search(const Image* ref_level, const Image* alt_level,
+                                       int upsampling_factor, int tile_size, int prev_tile_size,
+                                       AlignmentMap* neighbors_x, AlignmentMap* neighbors_y);
+
+// Per-tile alternatives to the predicted alignment; each tile starts its
+// search from whichever of them matches best
+typedef struct {
+    const AlignmentMap* maps[3];
+    int count;
+    const AlignmentMap* prior;      // One of maps, checked for coherence (may be NULL)
+    int confident_radius;           // Radius where the prior is coherent (0 for the full radius)
+} SearchCenters;
+
+// Returns false, leaving the predictions unsearched, if scratch runs out
+static bool local_search(const Image* ref_level, const Image* alt_level,
+                        const PackedImage* ref_packed, const PackedImage* alt_packed,
                         int tile_size, int search_radius,
-                        AlignmentMap* alignments, int distance_metric);
+                        AlignmentMap* alignments, int distance_metric,
+                        const BlockMatchingParams* params, const SearchCenters* centers,
+                        bool subpixel);
+
+// Integer copy of a level, if the pyramid keeps them
+static const PackedImage* packed_level(const ImagePyramid* pyramid, int level) {
+    return pyramid->packed_levels ? pyramid->packed_levels[level] : NULL;
+}
 
 // Implementation of core functions
 ImagePyramid* init_block_matching(const Image* ref_img, const BlockMatchingParams* params) {
@@ -33,6 +57,7 @@ ImagePyramid* init_block_matching(const Image* ref_img, const BlockMatchingParam
         return NULL;
     }
 
+    PROF_SCOPE(PROF_STAGE_PYRAMID);
     ImagePyramid* pyramid = create_image_pyramid(params->num_levels);
     if (!pyramid) {
         printf("Failed to create image pyramid\n");
@@ -40,7 +65,7 @@ ImagePyramid* init_block_matching(const Image* ref_img, const BlockMatchingParam
     }
 
     // Create first level (original resolution or initial downsampling)
-    pyramid->levels[0] = downsample_image(ref_img, params->factors[0]);
+    pyramid->levels[0] = downsample_image(ref_img, params->factors[0], params->thread_pool, params->arena);
     if (!pyramid->levels[0]) {
         printf("Failed to create first pyramid level with factor %d\n", params->factors[0]);
         free_image_pyramid(pyramid);
@@ -49,7 +74,8 @@ ImagePyramid* init_block_matching(const Image* ref_img, const BlockMatchingParam
 
     // Create subsequent levels
     for (int i = 1; i < params->num_levels; i++) {
-        pyramid->levels[i] = downsample_image(pyramid->levels[i-1], params->factors[i]);
+        pyramid->levels[i] = downsample_image(pyramid->levels[i-1], params->factors[i], params->thread_pool,
+                                              params->arena);
         if (!pyramid->levels[i]) {
             printf("Failed to create pyramid level %d with factor %d\n", i, params->factors[i]);
             free_image_pyramid(pyramid);
@@ -57,6 +83,23 @@ ImagePyramid* init_block_matching(const Image* ref_img, const BlockMatchingParam
         }
     }
 
+    // Integer copies for the search, a quarter or half the bytes per candidate
+    if (params->pixel_format != PIXEL_FORMAT_FLOAT) {
+        pyramid->packed_levels = (PackedImage**)calloc(params->num_levels, sizeof(PackedImage*));
+        if (!pyramid->packed_levels) {
+            free_image_pyramid(pyramid);
+            return NULL;
+        }
+        for (int i = 0; i < params->num_levels; i++) {
+            pyramid->packed_levels[i] = pack_image(pyramid->levels[i], params->pixel_format);
+            if (!pyramid->packed_levels[i]) {
+                printf("Failed to pack pyramid level %d\n", i);
+                free_image_pyramid(pyramid);
+                return NULL;
+            }
+        }
+    }
+
     return pyramid;
 }
 
@@ -66,6 +109,27 @@ AlignmentMap* align_image_block_matching(const Image* img, const ImagePyramid* r
     ImagePyramid* alt_pyramid = init_block_matching(img, params);
     if (!alt_pyramid) return NULL;
 
+    AlignmentMap* alignments = align_pyramids_block_matching(alt_pyramid, reference_pyramid, params);
+
+    free_image_pyramid(alt_pyramid);
+    return alignments;
+}
+
+AlignmentMap* align_pyramids_block_matching(const ImagePyramid* alt_pyramid, const ImagePyramid* reference_pyramid,
+                                          const BlockMatchingParams* params) {
+    return align_pyramids_block_matching_with_prior(alt_pyramid, reference_pyramid, params, NULL);
+}
+
+AlignmentMap* align_pyramids_block_matching_with_prior(const ImagePyramid* alt_pyramid,
+                                                     const ImagePyramid* reference_pyramid,
+                                                     const BlockMatchingParams* params,
+                                                     const AlignmentPrior* prior) {
+    if (prior && !prior->alignments) prior = NULL;
+    if (alt_pyramid->levels[0]->layout != reference_pyramid->levels[0]->layout) {
+        printf("Error: pyramids have different channel layouts\n");
+        return NULL;
+    }
+    PROF_SCOPE(PROF_STAGE_BLOCK_MATCHING);
     AlignmentMap* alignments = NULL;
     
     // Process from coarsest to finest level
@@ -73,9 +137,12 @@ AlignmentMap* align_image_block_matching(const Image* img, const ImagePyramid* r
         AlignmentMap* level_alignments = align_on_level(
             reference_pyramid->levels[level],
             alt_pyramid->levels[level],
+            packed_level(reference_pyramid, level),
+            packed_level(alt_pyramid, level),
             params,
             level,
-            alignments
+            alignments,
+            prior
         );
 
         // Free previous level alignments
@@ -83,139 +150,868 @@ AlignmentMap* align_image_block_matching(const Image* img, const ImagePyramid* r
             free_alignment_map(alignments);
         }
         alignments = level_alignments;
+        if (!alignments) return NULL;
     }
 
-    free_image_pyramid(alt_pyramid);
     return alignments;
 }
 
-static Image* downsample_image(const Image* img, int factor) {
+bool refine_alignments_block_matching(const ImagePyramid* alt_pyramid, const ImagePyramid* reference_pyramid,
+                                      const BlockMatchingParams* params, int search_radius,
+                                      AlignmentMap* alignments) {
+    if (!alt_pyramid || !reference_pyramid || !params || !alignments || search_radius < 0) return false;
+    if (alt_pyramid->levels[0]->layout != reference_pyramid->levels[0]->layout) {
+        printf("Error: pyramids have different channel layouts\n");
+        return false;
+    }
+
+    const Image* ref_level = reference_pyramid->levels[0];
+    int tile_size = params->tile_sizes[0];
+    if (alignments->height != ref_level->height / tile_size ||
+        alignments->width != ref_level->width / tile_size) {
+        printf("Error: %dx%d alignments do not match the %dx%d tile grid\n",
+               alignments->width, alignments->height,
+               ref_level->width / tile_size, ref_level->height / tile_size);
+        return false;
+    }
+
+    PROF_SCOPE(PROF_STAGE_BLOCK_MATCHING);
+    if (!local_search(ref_level, alt_pyramid->levels[0],
+                      packed_level(reference_pyramid, 0), packed_level(alt_pyramid, 0),
+                      tile_size, search_radius,
+                      alignments, params->distances[0], params, NULL, params->subpixel)) {
+        printf("Error: out of block matching scratch\n");
+        return false;
+    }
+    return true;
+}
+
+// Shared state for decimating one level, split into bands of output rows
+typedef struct {
+    const Image* src;
+    Image* dst;
+    int factor;
+    const float* weights;   // taps = factor + 2 * radius, same for rows and columns
+    int taps;
+    int radius;             // Input samples read beyond each factor x factor block
+    int rows_per_band;
+    float* rows;            // row_floats of scratch per band
+    size_t row_floats;
+} DownsampleJob;
+
+static void downsample_band(void* ctx, int band) {
+    const DownsampleJob* job = (const DownsampleJob*)ctx;
+    const Image* src = job->src;
+    Image* dst = job->dst;
+    // Planes are decimated one at a time, each as a single-channel image
+    bool planar = src->layout == IMAGE_LAYOUT_PLANAR;
+    int planes = planar ? src->channels : 1;
+    int channels = planar ? 1 : src->channels;
+    int row_len = src->width * channels;
+    int factor = job->factor;
+    int radius = job->radius;
+
+    int first_row = band * job->rows_per_band;
+    int last_row = first_row + job->rows_per_band;
+    if (last_row > dst->height) last_row = dst->height;
+
+    // One vertically filtered input row, padded by `radius` replicated pixels
+    // on each side so the horizontal pass needs no bounds checks. It is then
+    // split into `factor` phases per channel so every horizontal tap becomes a
+    // unit-stride multiply-add over the output row.
+    int padded_width = src->width + 2 * radius;
+    int phase_len = (padded_width + factor - 1) / factor;
+    float* row = job->rows + band * job->row_floats;
+    float* center = row + radius * channels;
+    float* phases = row + padded_width * channels;
+    float* out_plane = phases + phase_len * factor * channels;
+
+    for (int plane = 0; plane < planes; plane++) {
+        const pixel_t* src_plane = image_plane(src, plane);
+        pixel_t* dst_plane = image_plane(dst, plane);
+        for (int y = first_row; y < last_row; y++) {
+            // Vertical pass: weighted sum of whole input rows (contiguous, vectorizes)
+            int src_y = y * factor - radius;
+            for (int k = 0; k < job->taps; k++) {
+                int in_y = src_y + k;
+                if (in_y < 0) in_y = 0;
+                if (in_y >= src->height) in_y = src->height - 1;
+                const pixel_t* in = &src_plane[(size_t)in_y * src->pitch];
+                float w = job->weights[k];
+                if (k == 0) {
+                    for (int i = 0; i < row_len; i++) center[i] = w * in[i];
+                } else {
+                    for (int i = 0; i < row_len; i++) center[i] += w * in[i];
+                }
+            }
+            for (int p = 1; p <= radius; p++) {
+                for (int c = 0; c < channels; c++) {
+                    center[-p * channels + c] = center[c];
+                    center[(src->width - 1 + p) * channels + c] = center[(src->width - 1) * channels + c];
+                }
+            }
+
+            // Split into phases: phase p of channel c holds padded samples p, p + factor, ...
+            for (int c = 0; c < channels; c++) {
+                for (int p = 0; p < factor; p++) {
+                    float* phase = &phases[(c * factor + p) * phase_len];
+                    for (int i = 0; i * factor + p < padded_width; i++) {
+                        phase[i] = row[(i * factor + p) * channels + c];
+                    }
+                }
+            }
+
+            // Horizontal pass with decimation: tap k reads phase k % factor shifted by k / factor
+            pixel_t* out = &dst_plane[(size_t)y * dst->pitch];
+            for (int c = 0; c < channels; c++) {
+                float* acc = channels == 1 ? out : out_plane;
+                for (int k = 0; k < job->taps; k++) {
+                    const float* phase = &phases[(c * factor + k % factor) * phase_len + k / factor];
+                    float w = job->weights[k];
+                    if (k == 0) {
+                        for (int x = 0; x < dst->width; x++) acc[x] = w * phase[x];
+                    } else {
+                        for (int x = 0; x < dst->width; x++) acc[x] += w * phase[x];
+                    }
+                }
+                if (channels > 1) {
+                    for (int x = 0; x < dst->width; x++) {
+                        out[x * channels + c] = out_plane[x];
+                    }
+                }
+            }
+        }
+    }
+}
+
+static Image* downsample_image(const Image* img, int factor, ThreadPool* pool, FrameArena* arena) {
     if (factor <= 0) return NULL;
     if (factor == 1) {
         // Create a copy of the image
-        Image* copy = create_image(img->height, img->width, img->channels);
+        Image* copy = image_pool_acquire(img->pool, img->height, img->width, img->channels, img->layout,
+                                         img->border);
         if (!copy) return NULL;
-        memcpy(copy->data, img->data, sizeof(pixel_t) * img->height * img->width * img->channels);
+        memcpy(copy->buffer, img->buffer, sizeof(pixel_t) * image_num_samples(img));
         return copy;
     }
 
     int new_height = img->height / factor;
     int new_width = img->width / factor;
-    Image* downsampled = create_image(new_height, new_width, img->channels);
+    Image* downsampled = image_pool_acquire(img->pool, new_height, new_width, img->channels, img->layout, 0);
     if (!downsampled) return NULL;
 
-    // Simple box filter downsampling for each channel
-    for (int c = 0; c < img->channels; c++) {
-        for (int y = 0; y < new_height; y++) {
-            for (int x = 0; x < new_width; x++) {
-                float sum = 0.0f;
-                for (int ky = 0; ky < factor; ky++) {
-                    for (int kx = 0; kx < factor; kx++) {
-                        int orig_y = y * factor + ky;
-                        int orig_x = x * factor + kx;
-                        sum += img->data[(orig_y * img->width + orig_x) * img->channels + c];
-                    }
-                }
-                downsampled->data[(y * new_width + x) * img->channels + c] = sum / (factor * factor);
-            }
-        }
+    // Separable Gaussian anti-aliasing (sigma = factor / 2) centered on each
+    // factor x factor block, sampled over the block plus `factor` pixels per side
+    FrameArenaMark mark = frame_arena_mark(arena);
+    int radius = factor;
+    int taps = factor + 2 * radius;
+    float* weights = (float*)frame_arena_alloc(arena, sizeof(float) * taps);
+    if (!weights) {
+        free_image(downsampled);
+        return NULL;
+    }
+    float sigma = 0.5f * factor;
+    float block_center = 0.5f * (factor - 1);
+    float weight_sum = 0.0f;
+    for (int k = 0; k < taps; k++) {
+        float d = (k - radius) - block_center;
+        weights[k] = expf(-d * d / (2.0f * sigma * sigma));
+        weight_sum += weights[k];
     }
+    for (int k = 0; k < taps; k++) {
+        weights[k] /= weight_sum;
+    }
+
+    DownsampleJob job = {
+        .src = img,
+        .dst = downsampled,
+        .factor = factor,
+        .weights = weights,
+        .taps = taps,
+        .radius = radius,
+    };
 
+    int num_bands = thread_pool_num_threads(pool) * 4;
+    if (num_bands > new_height) num_bands = new_height;
+    bool ok = true;
+    if (num_bands >= 1) {
+        job.rows_per_band = (new_height + num_bands - 1) / num_bands;
+        num_bands = (new_height + job.rows_per_band - 1) / job.rows_per_band;
+
+        // Each band's filtered row, its phases and one output plane (see downsample_band)
+        int channels = img->layout == IMAGE_LAYOUT_PLANAR ? 1 : img->channels;
+        int padded_width = img->width + 2 * radius;
+        int phase_len = (padded_width + factor - 1) / factor;
+        job.row_floats = (size_t)padded_width * channels + (size_t)phase_len * factor * channels + new_width;
+        job.rows = (float*)frame_arena_alloc(arena, sizeof(float) * job.row_floats * num_bands);
+        ok = job.rows != NULL;
+        if (ok) thread_pool_parallel_for(pool, num_bands, downsample_band, &job);
+        frame_arena_free(arena, job.rows);
+    }
+
+    frame_arena_free(arena, weights);
+    frame_arena_release(arena, mark);
+    if (!ok) {
+        free_image(downsampled);
+        return NULL;
+    }
     return downsampled;
 }
 
+// Sample the prior on a level's tile grid: each tile takes the vector of the
+// finest-level tile under its center, scaled down to the level's pixels
+static AlignmentMap* resample_prior(const AlignmentPrior* prior, const BlockMatchingParams* params,
+                                    int level_idx, int n_tiles_y, int n_tiles_x) {
+    const AlignmentMap* src = prior->alignments;
+    int scale = 1;
+    for (int i = 1; i <= level_idx; i++) scale *= params->factors[i];
+    int tile_size = params->tile_sizes[level_idx];
+    int finest_tile_size = params->tile_sizes[0];
+
+    AlignmentMap* resampled = create_alignment_map(n_tiles_y, n_tiles_x);
+    if (!resampled) return NULL;
+
+    for (int y = 0; y < n_tiles_y; y++) {
+        int src_y = (y * tile_size + tile_size / 2) * scale / finest_tile_size;
+        if (src_y >= src->height) src_y = src->height - 1;
+        for (int x = 0; x < n_tiles_x; x++) {
+            int src_x = (x * tile_size + tile_size / 2) * scale / finest_tile_size;
+            if (src_x >= src->width) src_x = src->width - 1;
+            Alignment a = src->data[src_y * src->width + src_x];
+            resampled->data[y * n_tiles_x + x].x = roundf(a.x / scale);
+            resampled->data[y * n_tiles_x + x].y = roundf(a.y / scale);
+        }
+    }
+    return resampled;
+}
+
 static AlignmentMap* align_on_level(const Image* ref_level, const Image* alt_level,
+                                  const PackedImage* ref_packed, const PackedImage* alt_packed,
                                   const BlockMatchingParams* params, int level_idx,
-                                  const AlignmentMap* prev_alignments) {
+                                  const AlignmentMap* prev_alignments, const AlignmentPrior* prior) {
     int tile_size = params->tile_sizes[level_idx];
     int n_tiles_y = ref_level->height / tile_size;
     int n_tiles_x = ref_level->width / tile_size;
 
+    AlignmentMap* level_prior = NULL;
+    if (prior && (prior->candidate || (prior->initial_guess && prev_alignments == NULL))) {
+        level_prior = resample_prior(prior, params, level_idx, n_tiles_y, n_tiles_x);
+        if (!level_prior) return NULL;
+    }
+
+    SearchCenters centers = {.count = 0, .prior = NULL, .confident_radius = 0};
+    AlignmentMap* neighbors_x = NULL;
+    AlignmentMap* neighbors_y = NULL;
     AlignmentMap* alignments;
     if (prev_alignments == NULL) {
-        // Initialize with zero alignments
         alignments = create_alignment_map(n_tiles_y, n_tiles_x);
-        if (!alignments) return NULL;
-        memset(alignments->data, 0, sizeof(Alignment) * n_tiles_y * n_tiles_x);
+        if (!alignments) {
+            free_alignment_map(level_prior);
+            return NULL;
+        }
+        if (prior && prior->initial_guess) {
+            // Start from the prior instead of zero
+            memcpy(alignments->data, level_prior->data, sizeof(Alignment) * n_tiles_y * n_tiles_x);
+        } else {
+            // Initialize with zero alignments
+            memset(alignments->data, 0, sizeof(Alignment) * n_tiles_y * n_tiles_x);
+        }
     } else {
-        // Upsample previous alignments
+        // Upsample previous alignments, with the next nearest coarse vectors
+        // on each axis as alternatives near motion boundaries
         int prev_tile_size = params->tile_sizes[level_idx + 1];
         int upsampling_factor = params->factors[level_idx];
+        if (params->upsample_candidates) {
+            neighbors_x = create_alignment_map(n_tiles_y, n_tiles_x);
+            neighbors_y = create_alignment_map(n_tiles_y, n_tiles_x);
+            if (!neighbors_x || !neighbors_y) {
+                free_alignment_map(neighbors_x);
+                free_alignment_map(neighbors_y);
+                free_alignment_map(level_prior);
+                return NULL;
+            }
+            centers.maps[centers.count++] = neighbors_x;
+            centers.maps[centers.count++] = neighbors_y;
+        }
         alignments = upsample_alignments(ref_level, alt_level, prev_alignments,
-                                       upsampling_factor, tile_size, prev_tile_size);
-        if (!alignments) return NULL;
+                                       upsampling_factor, tile_size, prev_tile_size,
+                                       neighbors_x, neighbors_y);
+        if (!alignments) {
+            free_alignment_map(neighbors_x);
+            free_alignment_map(neighbors_y);
+            free_alignment_map(level_prior);
+            return NULL;
+        }
+    }
+
+    if (prior && prior->candidate) {
+        centers.maps[centers.count++] = level_prior;
+        centers.prior = level_prior;
+        centers.confident_radius = prior->confident_radius;
     }
 
     // Perform local search
-    local_search(ref_level, alt_level, tile_size, params->search_radii[level_idx],
-                alignments, params->distances[level_idx]);
+    bool searched = local_search(ref_level, alt_level, ref_packed, alt_packed,
+                                 tile_size, params->search_radii[level_idx],
+                                 alignments, params->distances[level_idx], params,
+                                 centers.count > 0 ? &centers : NULL, params->subpixel && level_idx == 0);
 
+    free_alignment_map(neighbors_x);
+    free_alignment_map(neighbors_y);
+    free_alignment_map(level_prior);
+    if (!searched) {
+        printf("Error: out of block matching scratch on level %d\n", level_idx);
+        free_alignment_map(alignments);
+        return NULL;
+    }
     return alignments;
 }
 
-static void local_search(const Image* ref_level, const Image* alt_level,
-                        int tile_size, int search_radius,
-                        AlignmentMap* alignments, int distance_metric) {
-    for (int tile_y = 0; tile_y < alignments->height; tile_y++) {
-        for (int tile_x = 0; tile_x < alignments->width; tile_x++) {
-            float min_dist = FLT_MAX;
-            float best_shift_x = 0;
-            float best_shift_y = 0;
-            Alignment current = alignments->data[tile_y * alignments->width + tile_x];
-
-            // Search window
-            for (int dy = -search_radius; dy <= search_radius; dy++) {
-                for (int dx = -search_radius; dx <= search_radius; dx++) {
-                    float dist = 0;
-                    int valid = 1;
-
-                    // Compare patches
-                    for (int y = 0; y < tile_size && valid; y++) {
-                        for (int x = 0; x < tile_size && valid; x++) {
-                            int ref_y = tile_y * tile_size + y;
-                            int ref_x = tile_x * tile_size + x;
-                            int alt_y = ref_y + (int)(current.y + dy);
-                            int alt_x = ref_x + (int)(current.x + dx);
-
-                            // Check bounds
-                            if (alt_x < 0 || alt_x >= alt_level->width ||
-                                alt_y < 0 || alt_y >= alt_level->height) {
-                                valid = 0;
-                                break;
-                            }
-
-                            // Compare all channels
-                            for (int c = 0; c < ref_level->channels; c++) {
-                                float diff = ref_level->data[(ref_y * ref_level->width + ref_x) * ref_level->channels + c] -
-                                           alt_level->data[(alt_y * alt_level->width + alt_x) * alt_level->channels + c];
-
-                                if (distance_metric == 0) {  // L1 distance
-                                    dist += fabsf(diff);
-                                } else {  // L2 distance
-                                    dist += diff * diff;
-                                }
-                            }
-                        }
-                    }
+// Candidate displacement relative to the predicted alignment
+typedef struct {
+    int dx;
+    int dy;
+} SearchOffset;
 
-                    if (valid && dist < min_dist) {
-                        min_dist = dist;
-                        best_shift_x = dx;
-                        best_shift_y = dy;
-                    }
-                }
+// Search patterns, as steps from the current best candidate
+static const SearchOffset SMALL_DIAMOND[] = {{0, -1}, {-1, 0}, {1, 0}, {0, 1}};
+static const SearchOffset LARGE_DIAMOND[] = {{0, -2}, {-1, -1}, {1, -1}, {-2, 0},
+                                             {2, 0}, {-1, 1}, {1, 1}, {0, 2}};
+static const SearchOffset HEXAGON[] = {{-1, -2}, {1, -2}, {-2, 0}, {2, 0}, {-1, 2}, {1, 2}};
+static const SearchOffset SQUARE[] = {{-1, -1}, {0, -1}, {1, -1}, {-1, 0},
+                                      {1, 0}, {-1, 1}, {0, 1}, {1, 1}};
+#define PATTERN_SIZE(p) ((int)(sizeof(p) / sizeof((p)[0])))
+
+// Shared state for one level's local search, split into bands of tile rows
+typedef struct {
+    const Image* ref_level;
+    const Image* alt_level;
+    const PackedImage* ref_packed;  // Searched instead of the levels when set
+    const PackedImage* alt_packed;
+    PackedTileDistanceFn packed_distance;
+    AlignmentMap* alignments;
+    const AlignmentMap* predictions;  // Alignments before the search (EPZS only)
+    const SearchCenters* centers;   // Alternative search centers (may be NULL)
+    TileDistanceFn tile_distance;
+    const SearchOffset* offsets;    // Exhaustive candidates in visiting order
+    int num_offsets;
+    int tile_size;
+    int search_radius;
+    SearchStrategy strategy;
+    bool partial_distance;
+    bool spiral;
+    bool subpixel;                  // Refine the integer minimum with a quadratic fit
+    int rows_per_band;
+    int* visited;                   // window^2 stamps per band
+    float* costs;                   // window^2 distances per band (subpixel only)
+    BlockMatchingStats* stats;
+} LocalSearchJob;
+
+// Per-tile search state
+typedef struct {
+    const pixel_t* ref_tile;
+    const void* ref_packed_tile;
+    int ref_x;
+    int ref_y;
+    Alignment current;          // Predicted alignment the offsets are relative to
+    int radius;                 // Search radius for this tile, at most the job's
+    float min_dist;
+    int best_dx;
+    int best_dy;
+    int* visited;               // Per-band stamps over the search window
+    float* costs;               // Full distance per visited offset, or -1 if cut short
+    int stamp;
+    BlockMatchingStats* counters;
+} TileSearch;
+
+// Fill offsets for a (2r+1)^2 window, either in raster order or ring by ring
+// outward from the prediction (raster order within each ring).
+static void build_search_offsets(SearchOffset* offsets, int search_radius, bool spiral) {
+    int n = 0;
+    if (!spiral) {
+        for (int dy = -search_radius; dy <= search_radius; dy++) {
+            for (int dx = -search_radius; dx <= search_radius; dx++) {
+                offsets[n].dx = dx;
+                offsets[n].dy = dy;
+                n++;
+            }
+        }
+        return;
+    }
+
+    for (int ring = 0; ring <= search_radius; ring++) {
+        for (int dy = -ring; dy <= ring; dy++) {
+            for (int dx = -ring; dx <= ring; dx++) {
+                if (abs(dx) != ring && abs(dy) != ring) continue;
+                offsets[n].dx = dx;
+                offsets[n].dy = dy;
+                n++;
+            }
+        }
+    }
+}
+
+static size_t pixel_format_size(PixelFormat format) {
+    switch (format) {
+        case PIXEL_FORMAT_U8: return sizeof(uint8_t);
+        case PIXEL_FORMAT_U16: return sizeof(uint16_t);
+        default: return sizeof(pixel_t);
+    }
+}
+
+// Offset of the first channel of sample (x, y), in samples
+static size_t sample_offset(ImageLayout layout, int pitch, int channels, int x, int y) {
+    return (size_t)y * pitch + (size_t)x * (layout == IMAGE_LAYOUT_PLANAR ? 1 : channels);
+}
+
+// Distance from the reference tile to the alternate tile at (alt_x, alt_y),
+// read from the integer levels when the job has them. Planar tiles sum one
+// single-channel distance per plane, each bounded by what the earlier planes
+// left, and report rows done averaged over the planes.
+static float tile_distance(const LocalSearchJob* job, const TileSearch* ts,
+                           int alt_x, int alt_y, float bound, int* rows_done) {
+    int tile_size = job->tile_size;
+    const Image* alt_level = job->alt_level;
+    bool planar = alt_level->layout == IMAGE_LAYOUT_PLANAR;
+    int planes = planar ? alt_level->channels : 1;
+    int row_len = planar ? tile_size : tile_size * alt_level->channels;
+    float dist = 0.0f;
+    int plane_rows = 0;
+
+    if (job->alt_packed) {
+        const PackedImage* ref = job->ref_packed;
+        const PackedImage* alt = job->alt_packed;
+        size_t sample = pixel_format_size(alt->format);
+        const char* alt_tile = (const char*)alt->data +
+            sample_offset(alt->layout, alt->pitch, alt->channels, alt_x, alt_y) * sample;
+        if (!planar) {
+            return job->packed_distance(ts->ref_packed_tile, ref->pitch, alt_tile, alt->pitch,
+                                        row_len, tile_size, bound, rows_done);
+        }
+        for (int c = 0; c < planes; c++) {
+            int done;
+            dist += job->packed_distance(ts->ref_packed_tile + (size_t)c * ref->height * ref->pitch * sample,
+                                         ref->pitch,
+                                         alt_tile + (size_t)c * alt->height * alt->pitch * sample,
+                                         alt->pitch, row_len, tile_size, bound - dist, &done);
+            plane_rows += done;
+            if (done < tile_size) break;
+        }
+    } else {
+        const Image* ref_level = job->ref_level;
+        const pixel_t* alt_tile = &alt_level->data[sample_offset(alt_level->layout, alt_level->pitch,
+                                                                 alt_level->channels, alt_x, alt_y)];
+        if (!planar) {
+            return job->tile_distance(ts->ref_tile, ref_level->pitch, alt_tile, alt_level->pitch,
+                                      row_len, tile_size, bound, rows_done);
+        }
+        for (int c = 0; c < planes; c++) {
+            int done;
+            dist += job->tile_distance(ts->ref_tile + c * ref_level->channel_stride, ref_level->pitch,
+                                       alt_tile + c * alt_level->channel_stride,
+                                       alt_level->pitch, row_len, tile_size, bound - dist, &done);
+            plane_rows += done;
+            if (done < tile_size) break;
+        }
+    }
+    *rows_done = plane_rows / planes;
+    // A plane can pass what the earlier ones left while the rounded total
+    // only reaches the bound, which would tie with the best instead of losing
+    if (plane_rows < planes * tile_size && dist <= bound) dist = nextafterf(bound, FLT_MAX);
+    return dist;
+}
+
+// Evaluate one displacement and keep it if it beats the best so far. Offsets
+// outside the search window or already evaluated for this tile are ignored.
+static void try_candidate(const LocalSearchJob* job, TileSearch* ts, int dx, int dy) {
+    int radius = ts->radius;
+    if (dx < -radius || dx > radius || dy < -radius || dy > radius) return;
+
+    int window = 2 * job->search_radius + 1;
+    int* visit = &ts->visited[(dy + job->search_radius) * window + (dx + job->search_radius)];
+    if (*visit == ts->stamp) return;
+    *visit = ts->stamp;
+
+    const Image* alt_level = job->alt_level;
+    int tile_size = job->tile_size;
+    int alt_y = ts->ref_y + (int)(ts->current.y + dy);
+    int alt_x = ts->ref_x + (int)(ts->current.x + dx);
+
+    // The whole displaced tile must lie inside the alternate image
+    if (alt_x < 0 || alt_x + tile_size > alt_level->width ||
+        alt_y < 0 || alt_y + tile_size > alt_level->height) return;
+
+    // A partial sum can only grow, so once it passes the best distance
+    // the candidate can neither win nor tie
+    int rows_done;
+    float dist = tile_distance(job, ts, alt_x, alt_y,
+                               job->partial_distance ? ts->min_dist : FLT_MAX, &rows_done);
+
+    ts->counters->candidates++;
+    ts->counters->rows_evaluated += rows_done;
+    ts->counters->rows_skipped += tile_size - rows_done;
+    if (ts->costs) {
+        ts->costs[(dy + job->search_radius) * window + (dx + job->search_radius)] =
+            rows_done == tile_size ? dist : -1.0f;
+    }
+
+    // Ties go to the first candidate in raster order, whatever the visiting order
+    if (dist < ts->min_dist ||
+        (dist == ts->min_dist && (dy < ts->best_dy || (dy == ts->best_dy && dx < ts->best_dx)))) {
+        ts->min_dist = dist;
+        ts->best_dx = dx;
+        ts->best_dy = dy;
+    }
+}
+
+// Move the pattern center to the best point until the center wins
+static void pattern_search(const LocalSearchJob* job, TileSearch* ts,
+                           const SearchOffset* pattern, int pattern_size, int max_steps) {
+    for (int step = 0; step < max_steps; step++) {
+        int center_dx = ts->best_dx;
+        int center_dy = ts->best_dy;
+        for (int i = 0; i < pattern_size; i++) {
+            try_candidate(job, ts, center_dx + pattern[i].dx, center_dy + pattern[i].dy);
+        }
+        if (ts->best_dx == center_dx && ts->best_dy == center_dy) break;
+    }
+}
+
+// EPZS-style seeds: the upsampled coarse vectors of the four neighbors and the
+// already refined vector of the left neighbor. Neighbors are read from the
+// pre-search predictions (and the left one from this band's own row) so the
+// result does not depend on how bands are scheduled.
+static void try_spatial_predictors(const LocalSearchJob* job, TileSearch* ts, int tile_y, int tile_x) {
+    const AlignmentMap* pred = job->predictions;
+    const int neighbors[4][2] = {{0, -1}, {-1, 0}, {1, 0}, {0, 1}};
+
+    for (int i = 0; i < 4; i++) {
+        int ny = tile_y + neighbors[i][1];
+        int nx = tile_x + neighbors[i][0];
+        if (nx < 0 || nx >= pred->width || ny < 0 || ny >= pred->height) continue;
+        Alignment a = pred->data[ny * pred->width + nx];
+        try_candidate(job, ts, (int)lroundf(a.x - ts->current.x), (int)lroundf(a.y - ts->current.y));
+    }
+
+    if (tile_x > 0) {
+        Alignment left = job->alignments->data[tile_y * job->alignments->width + tile_x - 1];
+        try_candidate(job, ts, (int)lroundf(left.x - ts->current.x), (int)lroundf(left.y - ts->current.y));
+    }
+}
+
+// Full distance between the reference tile and the alternate displaced by `a`,
+// or FLT_MAX if that tile leaves the image
+static float distance_at(const LocalSearchJob* job, TileSearch* ts, Alignment a) {
+    const Image* alt_level = job->alt_level;
+    int tile_size = job->tile_size;
+    int alt_y = ts->ref_y + (int)a.y;
+    int alt_x = ts->ref_x + (int)a.x;
+    if (alt_x < 0 || alt_x + tile_size > alt_level->width ||
+        alt_y < 0 || alt_y + tile_size > alt_level->height) return FLT_MAX;
+
+    int rows_done;
+    float dist = tile_distance(job, ts, alt_x, alt_y, FLT_MAX, &rows_done);
+    ts->counters->candidates++;
+    ts->counters->rows_evaluated += rows_done;
+    return dist;
+}
+
+// Recenter on the best matching alternative if it beats the prediction.
+// Where the chosen center is the prior and it agrees with its four neighbors
+// to within a pixel (a steady motion field), search only the confident radius.
+static void choose_center(const LocalSearchJob* job, TileSearch* ts, int tile_y, int tile_x) {
+    const SearchCenters* centers = job->centers;
+    int tile = tile_y * job->alignments->width + tile_x;
+    float best = -1.0f;  // Distance at the current center, evaluated on first use
+
+    for (int i = 0; i < centers->count; i++) {
+        Alignment a = centers->maps[i]->data[tile];
+        if (a.x == ts->current.x && a.y == ts->current.y) continue;
+        if (best < 0.0f) best = distance_at(job, ts, ts->current);
+        float dist = distance_at(job, ts, a);
+        if (dist < best) {
+            best = dist;
+            ts->current = a;
+        }
+    }
+
+    const AlignmentMap* prior = centers->prior;
+    if (!prior || centers->confident_radius <= 0 || centers->confident_radius >= ts->radius) return;
+    Alignment p = prior->data[tile];
+    if (p.x != ts->current.x || p.y != ts->current.y) return;
+    const int neighbors[4][2] = {{0, -1}, {-1, 0}, {1, 0}, {0, 1}};
+    for (int i = 0; i < 4; i++) {
+        int ny = tile_y + neighbors[i][1];
+        int nx = tile_x + neighbors[i][0];
+        if (nx < 0 || nx >= prior->width || ny < 0 || ny >= prior->height) continue;
+        Alignment n = prior->data[ny * prior->width + nx];
+        if (fabsf(n.x - p.x) > 1.0f || fabsf(n.y - p.y) > 1.0f) return;
+    }
+    ts->radius = centers->confident_radius;
+}
+
+// Least-squares fit of a*x^2 + b*y^2 + c*x*y + d*x + e*y + f to the 3x3
+// distances around the best integer offset, returning the minimum of the fit
+// clamped to half a pixel. Distances the search already computed in full are
+// reused; the rest are evaluated here. Returns zero where the fit has no
+// minimum or a neighbor falls outside the image.
+static Alignment subpixel_offset(const LocalSearchJob* job, TileSearch* ts) {
+    Alignment offset = {0, 0};
+    int radius = job->search_radius;
+    int window = 2 * radius + 1;
+    float cost[3][3];
+
+    for (int j = -1; j <= 1; j++) {
+        for (int i = -1; i <= 1; i++) {
+            int dx = ts->best_dx + i;
+            int dy = ts->best_dy + j;
+            float c = -1.0f;
+            if (abs(dx) <= radius && abs(dy) <= radius) {
+                int slot = (dy + radius) * window + (dx + radius);
+                if (ts->visited[slot] == ts->stamp) c = ts->costs[slot];
+            }
+            if (c < 0.0f) {
+                Alignment a = {ts->current.x + dx, ts->current.y + dy};
+                c = distance_at(job, ts, a);
+                if (c == FLT_MAX) return offset;
             }
+            cost[j + 1][i + 1] = c;
+        }
+    }
 
-            // Update alignment
-            alignments->data[tile_y * alignments->width + tile_x].x += best_shift_x;
-            alignments->data[tile_y * alignments->width + tile_x].y += best_shift_y;
+    // The basis 1, x, y, x^2 - 2/3, y^2 - 2/3, xy is orthogonal on the 3x3 grid
+    float sx = 0, sy = 0, sxy = 0, sxx = 0, syy = 0;
+    for (int j = -1; j <= 1; j++) {
+        for (int i = -1; i <= 1; i++) {
+            float c = cost[j + 1][i + 1];
+            sx += i * c;
+            sy += j * c;
+            sxy += i * j * c;
+            sxx += (i * i - 2.0f / 3.0f) * c;
+            syy += (j * j - 2.0f / 3.0f) * c;
         }
     }
+    float a = sxx / 2.0f, b = syy / 2.0f, c = sxy / 4.0f;
+    float d = sx / 6.0f, e = sy / 6.0f;
+
+    // Minimum where the gradient vanishes, if the fit is convex
+    float det = 4.0f * a * b - c * c;
+    if (a <= 0.0f || det <= 0.0f) return offset;
+    offset.x = fminf(fmaxf((c * e - 2.0f * b * d) / det, -0.5f), 0.5f);
+    offset.y = fminf(fmaxf((c * d - 2.0f * a * e) / det, -0.5f), 0.5f);
+    return offset;
+}
+
+static void search_tile(const LocalSearchJob* job, int tile_y, int tile_x, TileSearch* ts) {
+    AlignmentMap* alignments = job->alignments;
+    int tile_size = job->tile_size;
+    const Image* ref_level = job->ref_level;
+    int max_steps = 2 * job->search_radius + 1;
+
+    ts->ref_y = tile_y * tile_size;
+    ts->ref_x = tile_x * tile_size;
+    ts->ref_tile = &ref_level->data[sample_offset(ref_level->layout, ref_level->pitch,
+                                                  ref_level->channels, ts->ref_x, ts->ref_y)];
+    if (job->ref_packed) {
+        const PackedImage* ref = job->ref_packed;
+        ts->ref_packed_tile = (const char*)ref->data +
+            sample_offset(ref->layout, ref->pitch, ref->channels, ts->ref_x, ts->ref_y) *
+            pixel_format_size(ref->format);
+    }
+    ts->current = alignments->data[tile_y * alignments->width + tile_x];
+    ts->current.x = roundf(ts->current.x);  // Predictions may carry sub-pixel parts
+    ts->current.y = roundf(ts->current.y);
+    ts->radius = job->search_radius;
+    ts->min_dist = FLT_MAX;
+    ts->best_dx = 0;
+    ts->best_dy = 0;
+    ts->stamp++;
+
+    if (job->centers) {
+        choose_center(job, ts, tile_y, tile_x);
+    }
+
+    switch (job->strategy) {
+        case SEARCH_SMALL_DIAMOND:
+            try_candidate(job, ts, 0, 0);
+            pattern_search(job, ts, SMALL_DIAMOND, PATTERN_SIZE(SMALL_DIAMOND), max_steps);
+            break;
+        case SEARCH_LARGE_DIAMOND:
+            try_candidate(job, ts, 0, 0);
+            pattern_search(job, ts, LARGE_DIAMOND, PATTERN_SIZE(LARGE_DIAMOND), max_steps);
+            pattern_search(job, ts, SMALL_DIAMOND, PATTERN_SIZE(SMALL_DIAMOND), 1);
+            break;
+        case SEARCH_HEXAGON:
+            try_candidate(job, ts, 0, 0);
+            pattern_search(job, ts, HEXAGON, PATTERN_SIZE(HEXAGON), max_steps);
+            pattern_search(job, ts, SQUARE, PATTERN_SIZE(SQUARE), 1);
+            break;
+        case SEARCH_EPZS:
+            try_candidate(job, ts, 0, 0);
+            try_spatial_predictors(job, ts, tile_y, tile_x);
+            pattern_search(job, ts, SMALL_DIAMOND, PATTERN_SIZE(SMALL_DIAMOND), max_steps);
+            break;
+        case SEARCH_EXHAUSTIVE:
+        default: {
+            // Spiral offsets are ordered by ring, so a smaller window is a prefix
+            int num_offsets = job->num_offsets;
+            if (job->spiral && ts->radius < job->search_radius) {
+                num_offsets = (2 * ts->radius + 1) * (2 * ts->radius + 1);
+            }
+            for (int i = 0; i < num_offsets; i++) {
+                try_candidate(job, ts, job->offsets[i].dx, job->offsets[i].dy);
+            }
+            break;
+        }
+    }
+
+    // Update alignment
+    Alignment fraction = {0, 0};
+    if (job->subpixel && ts->min_dist < FLT_MAX) {
+        fraction = subpixel_offset(job, ts);
+    }
+    alignments->data[tile_y * alignments->width + tile_x].x = ts->current.x + ts->best_dx + fraction.x;
+    alignments->data[tile_y * alignments->width + tile_x].y = ts->current.y + ts->best_dy + fraction.y;
+}
+
+static void local_search_band(void* ctx, int band) {
+    const LocalSearchJob* job = (const LocalSearchJob*)ctx;
+    int first_row = band * job->rows_per_band;
+    int last_row = first_row + job->rows_per_band;
+    if (last_row > job->alignments->height) last_row = job->alignments->height;
+
+    size_t window_size = (size_t)(2 * job->search_radius + 1) * (2 * job->search_radius + 1);
+    BlockMatchingStats counters = {0, 0, 0};
+    TileSearch ts = {
+        .visited = job->visited + band * window_size,
+        .costs = job->costs ? job->costs + band * window_size : NULL,
+        .stamp = 0,
+        .counters = &counters,
+    };
+    memset(ts.visited, 0, sizeof(int) * window_size);
+
+    for (int tile_y = first_row; tile_y < last_row; tile_y++) {
+        for (int tile_x = 0; tile_x < job->alignments->width; tile_x++) {
+            search_tile(job, tile_y, tile_x, &ts);
+        }
+    }
+
+    PROF_COUNT(PROF_COUNTER_BM_CANDIDATES, counters.candidates);
+    PROF_COUNT(PROF_COUNTER_BM_ROWS_EVALUATED, counters.rows_evaluated);
+    PROF_COUNT(PROF_COUNTER_BM_ROWS_SKIPPED, counters.rows_skipped);
+    if (job->stats) {
+        __atomic_fetch_add(&job->stats->candidates, counters.candidates, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&job->stats->rows_evaluated, counters.rows_evaluated, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&job->stats->rows_skipped, counters.rows_skipped, __ATOMIC_RELAXED);
+    }
 }
 
+static bool local_search(const Image* ref_level, const Image* alt_level,
+                        const PackedImage* ref_packed, const PackedImage* alt_packed,
+                        int tile_size, int search_radius,
+                        AlignmentMap* alignments, int distance_metric,
+                        const BlockMatchingParams* params, const SearchCenters* centers,
+                        bool subpixel) {
+    // Both pyramids need integer copies in the same format to search those
+    if (!ref_packed || !alt_packed || ref_packed->format != alt_packed->format) {
+        ref_packed = NULL;
+        alt_packed = NULL;
+    }
+
+    // Scratch lives until the end of the call; the arena keeps it for the next
+    FrameArena* arena = params->arena;
+    FrameArenaMark mark = frame_arena_mark(arena);
+    int window = 2 * search_radius + 1;
+    SearchOffset* offsets = NULL;
+    AlignmentMap snapshot = {NULL, alignments->height, alignments->width};
+    AlignmentMap* predictions = NULL;
+
+    if (params->search_strategy == SEARCH_EXHAUSTIVE) {
+        offsets = (SearchOffset*)frame_arena_alloc(arena, sizeof(SearchOffset) * window * window);
+        if (!offsets) {
+            frame_arena_release(arena, mark);
+            return false;
+        }
+        build_search_offsets(offsets, search_radius, params->spiral_search);
+    } else if (params->search_strategy == SEARCH_EPZS) {
+        // Neighbors are updated in place, so seed from a snapshot
+        snapshot.data = (Alignment*)frame_arena_alloc(arena, sizeof(Alignment) * alignments->height *
+                                                             alignments->width);
+        if (!snapshot.data) {
+            frame_arena_release(arena, mark);
+            return false;
+        }
+        memcpy(snapshot.data, alignments->data,
+               sizeof(Alignment) * alignments->height * alignments->width);
+        predictions = &snapshot;
+    }
+
+    // Planar levels run the kernels over one channel's row at a time
+    int row_len = ref_level->layout == IMAGE_LAYOUT_PLANAR ? tile_size : tile_size * ref_level->channels;
+
+    LocalSearchJob job = {
+        .ref_level = ref_level,
+        .alt_level = alt_level,
+        .ref_packed = ref_packed,
+        .alt_packed = alt_packed,
+        .packed_distance = alt_packed ? select_packed_tile_distance(alt_packed->format, distance_metric,
+                                                                    row_len, detect_simd_level()) : NULL,
+        .alignments = alignments,
+        .predictions = predictions,
+        .centers = centers,
+        // Pick the distance kernel once per level instead of branching per sample
+        .tile_distance = select_tile_distance(distance_metric, row_len, detect_simd_level()),
+        .offsets = offsets,
+        .num_offsets = offsets ? window * window : 0,
+        .tile_size = tile_size,
+        .search_radius = search_radius,
+        .strategy = params->search_strategy,
+        .partial_distance = params->partial_distance,
+        .spiral = params->spiral_search,
+        .subpixel = subpixel,
+        .stats = params->stats,
+    };
+
+    // Tiles only write their own alignment, so bands can run in any order and
+    // the result matches the serial search exactly. A few bands per thread
+    // keep the load balanced when some rows hit the image border.
+    int num_bands = thread_pool_num_threads(params->thread_pool) * 4;
+    if (num_bands > alignments->height) num_bands = alignments->height;
+    bool ok = true;
+    if (num_bands >= 1) {
+        job.rows_per_band = (alignments->height + num_bands - 1) / num_bands;
+        num_bands = (alignments->height + job.rows_per_band - 1) / job.rows_per_band;
+        size_t band_scratch = (size_t)num_bands * window * window;
+        job.visited = (int*)frame_arena_alloc(arena, sizeof(int) * band_scratch);
+        if (subpixel) job.costs = (float*)frame_arena_alloc(arena, sizeof(float) * band_scratch);
+        ok = job.visited && (!subpixel || job.costs);
+        if (ok) thread_pool_parallel_for(params->thread_pool, num_bands, local_search_band, &job);
+        frame_arena_free(arena, job.costs);
+        frame_arena_free(arena, job.visited);
+    }
+
+    frame_arena_free(arena, snapshot.data);
+    frame_arena_free(arena, offsets);
+    frame_arena_release(arena, mark);
+    return ok;
+}
+
+// Scaled coarse vector at (x, y), or zero outside the coarse map
+static Alignment coarse_alignment(const AlignmentMap* prev_alignments, int x, int y, int upsampling_factor) {
+    Alignment a = {0, 0};
+    if (x < 0 || x >= prev_alignments->width || y < 0 || y >= prev_alignments->height) return a;
+    a.x = prev_alignments->data[y * prev_alignments->width + x].x * upsampling_factor;
+    a.y = prev_alignments->data[y * prev_alignments->width + x].y * upsampling_factor;
+    return a;
+}
+
+// Replicate each coarse vector over the fine tiles it covers. If neighbors_x
+// and neighbors_y are given, they receive the coarse vector next to the
+// nearest one on the side of the fine tile's center, along each axis.
 static AlignmentMap* upsample_alignments(const Image* ref_level, const Image* alt_level,
                                        const AlignmentMap* prev_alignments,
-                                       int upsampling_factor, int tile_size, int prev_tile_size) {
+                                       int upsampling_factor, int tile_size, int prev_tile_size,
+                                       AlignmentMap* neighbors_x, AlignmentMap* neighbors_y) {
     int repeat_factor = upsampling_factor / (tile_size / prev_tile_size);
     int new_height = ref_level->height / tile_size;
     int new_width = ref_level->width / tile_size;
@@ -225,11 +1021,14 @@ static AlignmentMap* upsample_alignments(const Image* ref_level, const Image* al
 
     for (int y = 0; y < new_height; y++) {
         for (int x = 0; x < new_width; x++) {
+            int idx = y * new_width + x;
             if (x >= repeat_factor * prev_alignments->width ||
                 y >= repeat_factor * prev_alignments->height) {
                 // Outside the previous alignment map
-                upsampled->data[y * new_width + x].x = 0;
-                upsampled->data[y * new_width + x].y = 0;
+                upsampled->data[idx].x = 0;
+                upsampled->data[idx].y = 0;
+                if (neighbors_x) neighbors_x->data[idx] = upsampled->data[idx];
+                if (neighbors_y) neighbors_y->data[idx] = upsampled->data[idx];
                 continue;
             }
 
@@ -237,10 +1036,22 @@ static AlignmentMap* upsample_alignments(const Image* ref_level, const Image* al
             int prev_y = y / repeat_factor;
             
             // Scale the previous alignment by the upsampling factor
-            upsampled->data[y * new_width + x].x = 
-                prev_alignments->data[prev_y * prev_alignments->width + prev_x].x * upsampling_factor;
-            upsampled->data[y * new_width + x].y = 
-                prev_alignments->data[prev_y * prev_alignments->width + prev_x].y * upsampling_factor;
+            upsampled->data[idx] = coarse_alignment(prev_alignments, prev_x, prev_y, upsampling_factor);
+
+            if (neighbors_x && neighbors_y) {
+                // Fine tile center in doubled fine pixels, the unit of the coarse tile
+                // center on the right (prev_tile_size * upsampling_factor fine pixels per tile)
+                int center_x = (x * tile_size + tile_size / 2) * 2;
+                int center_y = (y * tile_size + tile_size / 2) * 2;
+                int side_x = center_x < (2 * prev_x + 1) * prev_tile_size * upsampling_factor ? -1 : 1;
+                int side_y = center_y < (2 * prev_y + 1) * prev_tile_size * upsampling_factor ? -1 : 1;
+                int nx = prev_x + side_x;
+                int ny = prev_y + side_y;
+                if (nx < 0 || nx >= prev_alignments->width) nx = prev_x;
+                if (ny < 0 || ny >= prev_alignments->height) ny = prev_y;
+                neighbors_x->data[idx] = coarse_alignment(prev_alignments, nx, prev_y, upsampling_factor);
+                neighbors_y->data[idx] = coarse_alignment(prev_alignments, prev_x, ny, upsampling_factor);
+            }
         }
     }
 
@@ -249,28 +1060,254 @@ static AlignmentMap* upsample_alignments(const Image* ref_level, const Image* al
 
 // Memory management functions
 Image* create_image(int height, int width, int channels) {
+    return create_image_with_border(height, width, channels, IMAGE_LAYOUT_INTERLEAVED, 0);
+}
+
+Image* create_image_with_layout(int height, int width, int channels, ImageLayout layout) {
+    return create_image_with_border(height, width, channels, layout, 0);
+}
+
+// Round a sample count up to a whole number of SIMD-width blocks
+static int align_samples(int n) {
+    return (n + IMAGE_PLANAR_ALIGN - 1) / IMAGE_PLANAR_ALIGN * IMAGE_PLANAR_ALIGN;
+}
+
+// Rows are stored per plane: every channel's plane when planar, else one
+static int image_planes(const Image* img) {
+    return img->layout == IMAGE_LAYOUT_PLANAR ? img->channels : 1;
+}
+
+// Samples from one pixel to the next within a row
+static int pixel_stride(const Image* img) {
+    return img->layout == IMAGE_LAYOUT_PLANAR ? 1 : img->channels;
+}
+
+// Geometry of a buffer for the given image; returns the samples before (0, y) in its row
+static int init_image_geometry(Image* img, int height, int width, int channels, ImageLayout layout,
+                               int border) {
+    img->height = height;
+    img->width = width;
+    img->channels = channels;
+    img->layout = layout;
+    img->border = border;
+    img->pool = NULL;
+    img->view = false;
+    int rows = height + 2 * border;
+    int left;
+    if (layout == IMAGE_LAYOUT_PLANAR) {
+        left = align_samples(border);
+        img->pitch = align_samples(left + width + border);
+        img->channel_stride = (size_t)rows * img->pitch;
+        img->num_samples = img->channel_stride * channels;
+    } else {
+        left = border * channels;
+        img->pitch = (width + 2 * border) * channels;
+        img->channel_stride = 1;
+        img->num_samples = (size_t)rows * img->pitch;
+    }
+    return left;
+}
+
+Image* create_image_with_border(int height, int width, int channels, ImageLayout layout, int border) {
+    if (border < 0) return NULL;
     Image* img = (Image*)malloc(sizeof(Image));
     if (!img) return NULL;
     
-    img->data = (pixel_t*)malloc(sizeof(pixel_t) * height * width * channels);
-    if (!img->data) {
+    int left = init_image_geometry(img, height, width, channels, layout, border);
+    int rows = height + 2 * border;
+
+    // aligned_alloc wants a multiple of the alignment
+    size_t align = sizeof(pixel_t) * IMAGE_PLANAR_ALIGN;
+    size_t bytes = sizeof(pixel_t) * img->num_samples;
+    img->buffer = (pixel_t*)aligned_alloc(align, (bytes + align - 1) / align * align);
+    if (!img->buffer) {
         free(img);
         return NULL;
     }
+    img->data = img->buffer + (size_t)border * img->pitch + left;
     
+    // Zero the border and row padding so whole-buffer passes read defined values
+    int row_samples = width * pixel_stride(img);
+    if (img->num_samples > (size_t)height * row_samples * image_planes(img)) {
+        for (int p = 0; p < image_planes(img); p++) {
+            pixel_t* plane = img->buffer + (size_t)p * (layout == IMAGE_LAYOUT_PLANAR ? img->channel_stride : 0);
+            for (int y = 0; y < rows; y++) {
+                pixel_t* row = plane + (size_t)y * img->pitch;
+                if (y < border || y >= border + height) {
+                    memset(row, 0, sizeof(pixel_t) * img->pitch);
+                } else {
+                    memset(row, 0, sizeof(pixel_t) * left);
+                    memset(row + left + row_samples, 0, sizeof(pixel_t) * (img->pitch - left - row_samples));
+                }
+            }
+        }
+    }
+    return img;
+}
+
+void extend_image_border(Image* img) {
+    if (!img || img->border <= 0) return;
+    int border = img->border;
+    int step = pixel_stride(img);
+    int last = (img->width - 1) * step;
+    size_t row_bytes = sizeof(pixel_t) * (img->width + 2 * border) * step;
+
+    for (int p = 0; p < image_planes(img); p++) {
+        pixel_t* plane = image_plane(img, p);
+        // Left and right columns, then whole rows (corners included) above and below
+        for (int y = 0; y < img->height; y++) {
+            pixel_t* row = plane + (size_t)y * img->pitch;
+            for (int i = 1; i <= border; i++) {
+                for (int k = 0; k < step; k++) {
+                    row[-i * step + k] = row[k];
+                    row[last + i * step + k] = row[last + k];
+                }
+            }
+        }
+        const pixel_t* top = plane - border * step;
+        const pixel_t* bottom = top + (size_t)(img->height - 1) * img->pitch;
+        for (int i = 1; i <= border; i++) {
+            memcpy((pixel_t*)top - (size_t)i * img->pitch, top, row_bytes);
+            memcpy((pixel_t*)bottom + (size_t)i * img->pitch, bottom, row_bytes);
+        }
+    }
+}
+
+Image* convert_image(const Image* img, ImageLayout layout, int border) {
+    if (!img) return NULL;
+    Image* out = image_pool_acquire(img->pool, img->height, img->width, img->channels, layout, border);
+    if (out) copy_image(out, img);
+    return out;
+}
+
+bool copy_image(Image* out, const Image* img) {
+    if (out->height != img->height || out->width != img->width || out->channels != img->channels) {
+        return false;
+    }
+
+    if (out->layout == img->layout) {
+        // Rows keep their order, only pitch and border change
+        size_t row_bytes = sizeof(pixel_t) * img->width * pixel_stride(img);
+        for (int p = 0; p < image_planes(img); p++) {
+            const pixel_t* in = image_plane(img, p);
+            pixel_t* to = image_plane(out, p);
+            for (int y = 0; y < img->height; y++) {
+                memcpy(to + (size_t)y * out->pitch, in + (size_t)y * img->pitch, row_bytes);
+            }
+        }
+    } else {
+        int in_step = pixel_stride(img);
+        int out_step = pixel_stride(out);
+        for (int c = 0; c < img->channels; c++) {
+            const pixel_t* in_plane = image_plane(img, c);
+            pixel_t* out_plane = image_plane(out, c);
+            for (int y = 0; y < img->height; y++) {
+                const pixel_t* in = in_plane + (size_t)y * img->pitch;
+                pixel_t* to = out_plane + (size_t)y * out->pitch;
+                for (int x = 0; x < img->width; x++) to[x * out_step] = in[x * in_step];
+            }
+        }
+    }
+    extend_image_border(out);
+    return true;
+}
+
+Image* deinterleave_image(const Image* img) {
+    return img ? convert_image(img, IMAGE_LAYOUT_PLANAR, img->border) : NULL;
+}
+
+Image* interleave_image(const Image* img) {
+    return img ? convert_image(img, IMAGE_LAYOUT_INTERLEAVED, img->border) : NULL;
+}
+
+Image* create_image_view(const pixel_t* samples, int height, int width, int channels, ImageLayout layout,
+                         ImagePool* pool) {
+    if (!samples) return NULL;
+    Image* img = (Image*)malloc(sizeof(Image));
+    if (!img) return NULL;
+
+    init_image_geometry(img, height, width, channels, layout, 0);
+    img->buffer = (pixel_t*)samples;
+    img->data = img->buffer;
+    img->pool = pool;
+    img->view = true;
+    return img;
+}
+
+void free_image(Image* img) {
+    if (img && img->view) {
+        free(img);
+    } else if (img && img->pool) {
+        image_pool_release(img->pool, img);
+    } else if (img) {
+        free(img->buffer);
+        free(img);
+    }
+}
+
+PackedImage* create_packed_image(int height, int width, int channels, PixelFormat format,
+                                 ImageLayout layout) {
+    if (format != PIXEL_FORMAT_U8 && format != PIXEL_FORMAT_U16) return NULL;
+    PackedImage* img = (PackedImage*)malloc(sizeof(PackedImage));
+    if (!img) return NULL;
+
+    int pitch = layout == IMAGE_LAYOUT_PLANAR ? align_samples(width) : width * channels;
+    int rows = layout == IMAGE_LAYOUT_PLANAR ? height * channels : height;
+    img->data = malloc(pixel_format_size(format) * rows * pitch);
+    if (!img->data) {
+        free(img);
+        return NULL;
+    }
+
     img->height = height;
     img->width = width;
     img->channels = channels;
+    img->format = format;
+    img->layout = layout;
+    img->pitch = pitch;
+    img->pool = NULL;
     return img;
 }
 
-void free_image(Image* img) {
-    if (img) {
+void free_packed_image(PackedImage* img) {
+    if (img && img->pool) {
+        image_pool_release_packed(img->pool, img);
+    } else if (img) {
         free(img->data);
         free(img);
     }
 }
 
+PackedImage* pack_image(const Image* img, PixelFormat format) {
+    if (!img) return NULL;
+    PackedImage* packed = image_pool_acquire_packed(img->pool, img->height, img->width, img->channels, format,
+                                                    img->layout);
+    if (!packed) return NULL;
+
+    // Only the samples are packed; the border and row padding are not searched
+    int n = img->width * pixel_stride(img);
+    for (int p = 0; p < image_planes(img); p++) {
+        for (int y = 0; y < img->height; y++) {
+            const pixel_t* src = image_plane(img, p) + (size_t)y * img->pitch;
+            size_t row = (size_t)p * img->height + y;
+            if (format == PIXEL_FORMAT_U8) {
+                uint8_t* dst = (uint8_t*)packed->data + row * packed->pitch;
+                for (int i = 0; i < n; i++) {
+                    float v = fminf(fmaxf(src[i], 0.0f), 1.0f);
+                    dst[i] = (uint8_t)(v * 255.0f + 0.5f);
+                }
+            } else {
+                uint16_t* dst = (uint16_t*)packed->data + row * packed->pitch;
+                for (int i = 0; i < n; i++) {
+                    float v = fminf(fmaxf(src[i], 0.0f), 1.0f);
+                    dst[i] = (uint16_t)(v * 65535.0f + 0.5f);
+                }
+            }
+        }
+    }
+    return packed;
+}
+
 AlignmentMap* create_alignment_map(int height, int width) {
     AlignmentMap* map = (AlignmentMap*)malloc(sizeof(AlignmentMap));
     if (!map) return NULL;
@@ -303,6 +1340,7 @@ ImagePyramid* create_image_pyramid(int num_levels) {
         return NULL;
     }
     
+    pyramid->packed_levels = NULL;
     pyramid->num_levels = num_levels;
     memset(pyramid->levels, 0, sizeof(Image*) * num_levels);
     return pyramid;
@@ -312,8 +1350,10 @@ void free_image_pyramid(ImagePyramid* pyramid) {
     if (pyramid) {
         for (int i = 0; i < pyramid->num_levels; i++) {
             free_image(pyramid->levels[i]);
+            if (pyramid->packed_levels) free_packed_image(pyramid->packed_levels[i]);
         }
         free(pyramid->levels);
+        free(pyramid->packed_levels);
         free(pyramid);
     }
 }
@@ -323,6 +1363,16 @@ BlockMatchingParams* create_block_matching_params(int num_levels) {
     if (!params) return NULL;
     
     params->num_levels = num_levels;
+    params->num_threads = 1;
+    params->thread_pool = NULL;
+    params->partial_distance = true;
+    params->spiral_search = true;
+    params->search_strategy = SEARCH_EXHAUSTIVE;
+    params->upsample_candidates = false;
+    params->subpixel = false;
+    params->pixel_format = PIXEL_FORMAT_FLOAT;
+    params->stats = NULL;
+    params->arena = NULL;
     
     // Allocate and initialize arrays
     params->factors = malloc(sizeof(int) * num_levels);
@@ -345,6 +1395,24 @@ void free_block_matching_params(BlockMatchingParams* params) {
         free(params->tile_sizes);
         free(params->search_radii);
         free(params->distances);
+        free_thread_pool(params->thread_pool);
         free(params);
     }
 }
+
+bool set_block_matching_threads(BlockMatchingParams* params, int num_threads) {
+    if (!params) return false;
+    if (num_threads < 1) num_threads = 1;
+    if (num_threads == params->num_threads) return true;
+
+    ThreadPool* pool = NULL;
+    if (num_threads > 1) {
+        pool = create_thread_pool(num_threads);
+        if (!pool) return false;
+    }
+
+    free_thread_pool(params->thread_pool);
+    params->thread_pool = pool;
+    params->num_threads = num_threads;
+    return true;
+}
@@ -6,16 +6,42 @@
 #ifndef BLOCK_MATCHING_H
 #define BLOCK_MATCHING_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include "thread_pool.h"
 
 // Type definitions
 typedef float pixel_t;  // Default float type for pixel values
+
+// Buffer recycling (see frame_pool.h)
+typedef struct ImagePool ImagePool;
+typedef struct FrameArena FrameArena;
+
+// Sample order in Image and PackedImage data
+typedef enum {
+    IMAGE_LAYOUT_INTERLEAVED = 0,   // Sample (x, y, c) at y * pitch + x * channels + c
+    IMAGE_LAYOUT_PLANAR             // Sample (x, y, c) at (c * height + y) * pitch + x
+} ImageLayout;
+
+// Image buffers are aligned to this many samples (a 64-byte line of floats).
+// Planar rows are padded to a multiple of it and their left border rounded up
+// to one, so every row of every plane starts aligned.
+#define IMAGE_PLANAR_ALIGN 16
+
 typedef struct {
-    pixel_t* data;
+    pixel_t* data;      // Sample (0, 0) of the first channel
     int height;
     int width;
     int channels;  // Add number of channels
+    ImageLayout layout;
+    int pitch;     // Samples from one row to the next (within a plane when planar)
+    int border;    // Pixels around each plane that replicate its edges (see extend_image_border)
+    pixel_t* buffer;    // Allocation holding data, its border and row padding
+    size_t channel_stride; // Samples from one channel of a pixel to the next (1 when interleaved)
+    size_t num_samples;  // Samples in buffer
+    ImagePool* pool;     // Where free_image returns the image (NULL frees it)
+    bool view;           // Buffer is borrowed (see create_image_view)
 } Image;
 
 typedef struct {
@@ -29,11 +55,47 @@ typedef struct {
     int width;
 } AlignmentMap;
 
+// Sample storage for block matching pyramids
+typedef enum {
+    PIXEL_FORMAT_FLOAT = 0, // pixel_t only
+    PIXEL_FORMAT_U8,        // Also keep [0,1] quantized to 8 bits
+    PIXEL_FORMAT_U16        // Also keep [0,1] quantized to 16 bits
+} PixelFormat;
+
+// Integer image, laid out like the Image it was packed from
+typedef struct {
+    void* data;             // uint8_t or uint16_t per format
+    int height;
+    int width;
+    int channels;
+    PixelFormat format;
+    ImageLayout layout;
+    int pitch;
+    ImagePool* pool;        // Where free_packed_image returns it (NULL frees it)
+} PackedImage;
+
 typedef struct {
     Image** levels;
+    PackedImage** packed_levels;  // Integer copies searched instead of levels (NULL for float)
     int num_levels;
 } ImagePyramid;
 
+// Candidate search strategies for local_search
+typedef enum {
+    SEARCH_EXHAUSTIVE = 0,  // Every displacement in the search window
+    SEARCH_SMALL_DIAMOND,   // 4-point diamond steps
+    SEARCH_LARGE_DIAMOND,   // 8-point large diamond steps, small diamond refinement
+    SEARCH_HEXAGON,         // 6-point hexagon steps, 8-point square refinement
+    SEARCH_EPZS             // Coarse-level and spatial-neighbor predictors, then small diamond
+} SearchStrategy;
+
+// Search counters, accumulated when BlockMatchingParams.stats is set
+typedef struct {
+    long long candidates;       // Displacements evaluated
+    long long rows_evaluated;   // Tile rows accumulated
+    long long rows_skipped;     // Tile rows skipped by partial-distance elimination
+} BlockMatchingStats;
+
 // Parameters structure
 typedef struct {
     int* factors;           // Downsampling factors for each level
@@ -41,20 +103,94 @@ typedef struct {
     int* distances;         // Distance metrics for each level (0 for L1, 1 for L2)
     int* search_radii;      // Search radii for each level
     int num_levels;         // Number of pyramid levels
+    int num_threads;        // Threads for tile-parallel search (1 runs serially)
+    ThreadPool* thread_pool; // Owned; managed by set_block_matching_threads
+    bool partial_distance;  // Stop a candidate once its running distance exceeds the best
+    bool spiral_search;     // Visit candidates outward from the predicted displacement
+    SearchStrategy search_strategy; // Applied on every level (default exhaustive)
+    bool upsample_candidates; // Start each fine tile from the best of its three nearest coarse vectors
+    bool subpixel;          // Fit a quadratic to the 3x3 costs around each finest-level minimum
+    PixelFormat pixel_format; // Search integer copies of the pyramid levels (default float)
+    BlockMatchingStats* stats; // Optional counters (not owned, may be NULL)
+    FrameArena* arena;      // Optional search scratch (not owned, used by the calling thread)
 } BlockMatchingParams;
 
+// Alignments from a related pair (e.g. the previous frame's flow) used to
+// seed the search. They are on the finest level's tile grid, in its pixels.
+typedef struct {
+    const AlignmentMap* alignments;
+    bool initial_guess;     // Start the coarsest level from the prior instead of zero
+    bool candidate;         // On every level, search around the prior where it beats the coarse prediction
+    int confident_radius;   // Search radius where the prior is locally coherent (0 keeps the full radius)
+} AlignmentPrior;
+
 // Function declarations
 ImagePyramid* init_block_matching(const Image* ref_img, const BlockMatchingParams* params);
 AlignmentMap* align_image_block_matching(const Image* img, const ImagePyramid* reference_pyramid, const BlockMatchingParams* params);
+AlignmentMap* align_pyramids_block_matching(const ImagePyramid* alt_pyramid, const ImagePyramid* reference_pyramid,
+                                          const BlockMatchingParams* params);
+AlignmentMap* align_pyramids_block_matching_with_prior(const ImagePyramid* alt_pyramid,
+                                                     const ImagePyramid* reference_pyramid,
+                                                     const BlockMatchingParams* params,
+                                                     const AlignmentPrior* prior);
+// Re-run the finest level's local search with the given radius around the
+// alignments already in the map (e.g. composed from other flows), in place
+bool refine_alignments_block_matching(const ImagePyramid* alt_pyramid, const ImagePyramid* reference_pyramid,
+                                      const BlockMatchingParams* params, int search_radius,
+                                      AlignmentMap* alignments);
 void free_image_pyramid(ImagePyramid* pyramid);
 void free_alignment_map(AlignmentMap* alignments);
 
 // Utility functions
-Image* create_image(int height, int width, int channels);
+Image* create_image(int height, int width, int channels);  // Interleaved
+Image* create_image_with_layout(int height, int width, int channels, ImageLayout layout);
+// With a border, samples up to `border` pixels outside the image can be read
+// without bounds checks. Whoever writes the image calls extend_image_border
+// afterwards; until then the border is zero.
+Image* create_image_with_border(int height, int width, int channels, ImageLayout layout, int border);
+void extend_image_border(Image* img);
+// An image over samples it does not own, e.g. a memory-mapped frame, laid
+// out exactly like the buffer of create_image_with_border(..., border 0).
+// The samples are never written and must outlive the view; free_image frees
+// only the view. Images derived from it are drawn from `pool`.
+Image* create_image_view(const pixel_t* samples, int height, int width, int channels, ImageLayout layout,
+                         ImagePool* pool);
 void free_image(Image* img);
+
+// Copy into another layout and border, e.g. at the I/O boundary. The copy
+// comes from the same pool as img.
+Image* convert_image(const Image* img, ImageLayout layout, int border);
+// Copy the samples of an image of the same size in any layout and border
+bool copy_image(Image* dst, const Image* src);
+Image* deinterleave_image(const Image* img);  // Planar, same border
+Image* interleave_image(const Image* img);    // Interleaved, same border
+
+// Total samples in the buffer, including border and row padding
+static inline size_t image_num_samples(const Image* img) {
+    return img->num_samples;
+}
+
+// Channel c of pixel (0, 0); the whole plane when planar
+static inline pixel_t* image_plane(const Image* img, int c) {
+    return img->data + (size_t)c * img->channel_stride;
+}
+
+// Images whose buffers line up sample for sample, so whole-buffer passes
+// (e.g. averaging) can ignore the layout
+static inline bool image_same_geometry(const Image* a, const Image* b) {
+    return a->height == b->height && a->width == b->width && a->channels == b->channels &&
+           a->layout == b->layout && a->border == b->border;
+}
+
 AlignmentMap* create_alignment_map(int height, int width);
+PackedImage* create_packed_image(int height, int width, int channels, PixelFormat format,
+                                 ImageLayout layout);
+void free_packed_image(PackedImage* img);
+// Clamps to [0,1] and rounds; the copy comes from the same pool as img
+PackedImage* pack_image(const Image* img, PixelFormat format);
 ImagePyramid* create_image_pyramid(int num_levels);
 BlockMatchingParams* create_block_matching_params(int levels);
 void free_block_matching_params(BlockMatchingParams* params);
+bool set_block_matching_threads(BlockMatchingParams* params, int num_threads);
 
 #endif // BLOCK_MATCHING_H
@@ -0,0 +1,207 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "frame_pool.h"
+
+struct ImagePool {
+    Image** idle;           // Released images, any geometry
+    int num_idle;
+    int idle_capacity;
+    PackedImage** idle_packed;  // Released packed images, any geometry and format
+    int num_idle_packed;
+    int idle_packed_capacity;
+    long allocations;
+    pthread_mutex_t lock;
+};
+
+ImagePool* create_image_pool(void) {
+    ImagePool* pool = (ImagePool*)calloc(1, sizeof(ImagePool));
+    if (!pool) return NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+void free_image_pool(ImagePool* pool) {
+    if (!pool) return;
+    for (int i = 0; i < pool->num_idle; i++) {
+        pool->idle[i]->pool = NULL;
+        free_image(pool->idle[i]);
+    }
+    free(pool->idle);
+    for (int i = 0; i < pool->num_idle_packed; i++) {
+        pool->idle_packed[i]->pool = NULL;
+        free_packed_image(pool->idle_packed[i]);
+    }
+    free(pool->idle_packed);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+Image* image_pool_acquire(ImagePool* pool, int height, int width, int channels,
+                          ImageLayout layout, int border) {
+    if (!pool) return create_image_with_border(height, width, channels, layout, border);
+
+    // Few geometries are in flight at once, so a linear scan is enough
+    pthread_mutex_lock(&pool->lock);
+    for (int i = pool->num_idle - 1; i >= 0; i--) {
+        Image* img = pool->idle[i];
+        if (img->height == height && img->width == width && img->channels == channels &&
+            img->layout == layout && img->border == border) {
+            pool->idle[i] = pool->idle[--pool->num_idle];
+            pthread_mutex_unlock(&pool->lock);
+            return img;
+        }
+    }
+    pool->allocations++;
+    pthread_mutex_unlock(&pool->lock);
+
+    Image* img = create_image_with_border(height, width, channels, layout, border);
+    if (img) img->pool = pool;
+    return img;
+}
+
+void image_pool_release(ImagePool* pool, Image* img) {
+    pthread_mutex_lock(&pool->lock);
+    if (pool->num_idle == pool->idle_capacity) {
+        int capacity = pool->idle_capacity ? 2 * pool->idle_capacity : 16;
+        Image** idle = (Image**)realloc(pool->idle, sizeof(Image*) * capacity);
+        if (!idle) {
+            // Cannot keep it; give the memory back instead
+            pthread_mutex_unlock(&pool->lock);
+            img->pool = NULL;
+            free_image(img);
+            return;
+        }
+        pool->idle = idle;
+        pool->idle_capacity = capacity;
+    }
+    pool->idle[pool->num_idle++] = img;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+PackedImage* image_pool_acquire_packed(ImagePool* pool, int height, int width, int channels,
+                                       PixelFormat format, ImageLayout layout) {
+    if (!pool) return create_packed_image(height, width, channels, format, layout);
+
+    pthread_mutex_lock(&pool->lock);
+    for (int i = pool->num_idle_packed - 1; i >= 0; i--) {
+        PackedImage* img = pool->idle_packed[i];
+        if (img->height == height && img->width == width && img->channels == channels &&
+            img->format == format && img->layout == layout) {
+            pool->idle_packed[i] = pool->idle_packed[--pool->num_idle_packed];
+            pthread_mutex_unlock(&pool->lock);
+            return img;
+        }
+    }
+    pool->allocations++;
+    pthread_mutex_unlock(&pool->lock);
+
+    PackedImage* img = create_packed_image(height, width, channels, format, layout);
+    if (img) img->pool = pool;
+    return img;
+}
+
+void image_pool_release_packed(ImagePool* pool, PackedImage* img) {
+    pthread_mutex_lock(&pool->lock);
+    if (pool->num_idle_packed == pool->idle_packed_capacity) {
+        int capacity = pool->idle_packed_capacity ? 2 * pool->idle_packed_capacity : 16;
+        PackedImage** idle = (PackedImage**)realloc(pool->idle_packed, sizeof(PackedImage*) * capacity);
+        if (!idle) {
+            pthread_mutex_unlock(&pool->lock);
+            img->pool = NULL;
+            free_packed_image(img);
+            return;
+        }
+        pool->idle_packed = idle;
+        pool->idle_packed_capacity = capacity;
+    }
+    pool->idle_packed[pool->num_idle_packed++] = img;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+long image_pool_allocations(const ImagePool* pool) {
+    return pool ? pool->allocations : 0;
+}
+
+#define FRAME_ARENA_ALIGN 64
+#define FRAME_ARENA_MAX_BLOCKS 32
+
+typedef struct {
+    char* data;
+    size_t size;
+} FrameArenaBlock;
+
+struct FrameArena {
+    FrameArenaBlock blocks[FRAME_ARENA_MAX_BLOCKS];
+    int num_blocks;
+    size_t block_size;      // Minimum size of a new block
+    int current;            // Block allocations are served from
+    size_t offset;          // Bytes used in the current block
+};
+
+FrameArena* create_frame_arena(size_t block_size) {
+    FrameArena* arena = (FrameArena*)calloc(1, sizeof(FrameArena));
+    if (!arena) return NULL;
+    arena->block_size = block_size > 0 ? block_size : 1 << 20;
+    return arena;
+}
+
+void free_frame_arena(FrameArena* arena) {
+    if (!arena) return;
+    for (int i = 0; i < arena->num_blocks; i++) {
+        free(arena->blocks[i].data);
+    }
+    free(arena);
+}
+
+FrameArenaMark frame_arena_mark(const FrameArena* arena) {
+    FrameArenaMark mark = {0, 0};
+    if (arena) {
+        mark.block = arena->current;
+        mark.offset = arena->offset;
+    }
+    return mark;
+}
+
+void frame_arena_release(FrameArena* arena, FrameArenaMark mark) {
+    if (!arena) return;
+    arena->current = mark.block;
+    arena->offset = mark.offset;
+}
+
+void* frame_arena_alloc(FrameArena* arena, size_t bytes) {
+    size_t rounded = (bytes + FRAME_ARENA_ALIGN - 1) / FRAME_ARENA_ALIGN * FRAME_ARENA_ALIGN;
+    if (rounded == 0) rounded = FRAME_ARENA_ALIGN;
+    if (!arena) return aligned_alloc(FRAME_ARENA_ALIGN, rounded);
+
+    // Move on through the kept blocks until one has room, then add a block
+    while (arena->current < arena->num_blocks) {
+        FrameArenaBlock* block = &arena->blocks[arena->current];
+        if (arena->offset + rounded <= block->size) {
+            void* ptr = block->data + arena->offset;
+            arena->offset += rounded;
+            return ptr;
+        }
+        if (arena->current + 1 == arena->num_blocks) break;
+        arena->current++;
+        arena->offset = 0;
+    }
+    if (arena->num_blocks == FRAME_ARENA_MAX_BLOCKS) return NULL;
+
+    size_t size = rounded > arena->block_size ? rounded : arena->block_size;
+    char* data = (char*)aligned_alloc(FRAME_ARENA_ALIGN, size);
+    if (!data) return NULL;
+    arena->blocks[arena->num_blocks].data = data;
+    arena->blocks[arena->num_blocks].size = size;
+    arena->current = arena->num_blocks++;
+    arena->offset = rounded;
+    return data;
+}
+
+void frame_arena_free(FrameArena* arena, void* ptr) {
+    if (!arena) free(ptr);
+}
+
+int frame_arena_blocks(const FrameArena* arena) {
+    return arena ? arena->num_blocks : 0;
+}
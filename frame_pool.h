@@ -0,0 +1,56 @@
+/**
+ * @file frame_pool.h
+ * @brief Recycling pool for image buffers and a scratch arena for per-frame temporaries
+ */
+
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include <stddef.h>
+#include "block_matching.h"
+
+// Images released to a pool keep their buffers for the next acquire of the
+// same geometry, so a steady stream of frames stops allocating once every
+// geometry in flight has been seen. Safe to use from several threads.
+ImagePool* create_image_pool(void);
+void free_image_pool(ImagePool* pool);  // Frees idle images; live ones must be freed first
+
+// An image of the given geometry owned by the pool (free_image returns it).
+// Samples and border are undefined when recycled, so writers call
+// extend_image_border as usual; row padding stays zero. A NULL pool
+// allocates normally.
+Image* image_pool_acquire(ImagePool* pool, int height, int width, int channels,
+                          ImageLayout layout, int border);
+// Called by free_image for pooled images
+void image_pool_release(ImagePool* pool, Image* img);
+// Same for the integer copies of pyramid levels (see pack_image)
+PackedImage* image_pool_acquire_packed(ImagePool* pool, int height, int width, int channels,
+                                       PixelFormat format, ImageLayout layout);
+// Called by free_packed_image for pooled images
+void image_pool_release_packed(ImagePool* pool, PackedImage* img);
+// Images, packed ones included, the pool had to allocate so far (each miss on
+// the free lists)
+long image_pool_allocations(const ImagePool* pool);
+
+// Bump allocator for scratch memory. Allocations are released together by
+// rolling back to a mark, and its blocks are kept, so once a frame's peak
+// has been reached the same memory is handed out every frame. One thread at
+// a time. A NULL arena falls back to the heap: alloc mallocs, free frees,
+// marks do nothing.
+
+FrameArena* create_frame_arena(size_t block_size);
+void free_frame_arena(FrameArena* arena);
+
+typedef struct {
+    int block;
+    size_t offset;
+} FrameArenaMark;
+
+FrameArenaMark frame_arena_mark(const FrameArena* arena);
+void frame_arena_release(FrameArena* arena, FrameArenaMark mark);
+void* frame_arena_alloc(FrameArena* arena, size_t bytes);  // 64-byte aligned
+void frame_arena_free(FrameArena* arena, void* ptr);      // Heap fallback only
+// Blocks the arena has allocated so far
+int frame_arena_blocks(const FrameArena* arena);
+
+#endif // FRAME_POOL_H
@@ -2,16 +2,41 @@
 #include <string.h>
 #include <math.h>
 #include <float.h>
+#include <stdio.h>
 #include "ica.h"
+#include "profiler.h"
 
 // Helper function declarations
-static void gaussian_blur_1d(const float* input, float* output, int size, float sigma);
 static void compute_prewitt_gradients(const Image* img, ImageGradients* grads);
 static void compute_gaussian_kernel(float* kernel, int size, float sigma);
-static void bilinear_interpolation(const Image* img, float x, float y, float* result);
+
+// Gradients and warps index one sample per pixel as y * pitch + x, which
+// holds for one-channel images in either layout
+static bool is_single_plane(const Image* img) {
+    if (img->channels == 1) return true;
+    printf("Error: ICA needs one-channel images; pass the frame's alignment plane\n");
+    return false;
+}
+
+// refine_patch reads the Hessian of alignment tile (px, py) at the same
+// index, so it must hold one patch per tile_size tile, as compute_hessian
+// (or compute_hessian_integral with tile_step == tile_size) lays them out
+static bool hessian_matches_tiles(const HessianMatrix* hessian, const ImageGradients* grads,
+                                  const AlignmentMap* alignment, int tile_size) {
+    int n_patches_y = (grads->height + tile_size - 1) / tile_size;
+    int n_patches_x = (grads->width + tile_size - 1) / tile_size;
+    if (hessian->height == n_patches_y && hessian->width == n_patches_x &&
+        alignment->height <= n_patches_y && alignment->width <= n_patches_x) {
+        return true;
+    }
+    printf("Error: %dx%d Hessian patches do not match the %dx%d grid of %d-pixel tiles\n",
+           hessian->width, hessian->height, n_patches_x, n_patches_y, tile_size);
+    return false;
+}
 
 // Implementation of core functions
 ImageGradients* init_ica(const Image* ref_img, const ICAParams* params) {
+    if (!is_single_plane(ref_img)) return NULL;
     ImageGradients* grads = (ImageGradients*)malloc(sizeof(ImageGradients));
     if (!grads) return NULL;
 
@@ -25,89 +50,186 @@ ImageGradients* init_ica(const Image* ref_img, const ICAParams* params) {
         return NULL;
     }
 
-    // Compute gradients
-    compute_image_gradients(ref_img, grads, params->sigma_blur);
+    // Compute gradients, reusing the caller's blur engine when there is one
+    if (params->blur_engine && params->sigma_blur > 0 &&
+        set_blur_engine_sigma(params->blur_engine, params->sigma_blur)) {
+        compute_image_gradients_with_engine(ref_img, grads, params->blur_engine);
+    } else {
+        compute_image_gradients(ref_img, grads, params->sigma_blur);
+    }
     return grads;
 }
 
 void compute_image_gradients(const Image* img, ImageGradients* grads, float sigma_blur) {
-    // If blur is needed, create a temporary blurred image
-    Image* blurred_img = NULL;
-    const Image* working_img = img;
-
-    if (sigma_blur > 0) {
-        blurred_img = create_image(img->height, img->width, img->channels);
-        if (!blurred_img) return;
-
-        // Apply Gaussian blur
-        float* temp = (float*)malloc(sizeof(float) * img->width);
-        if (!temp) {
-            free_image(blurred_img);
-            return;
+    if (sigma_blur <= 0) {
+        compute_prewitt_gradients(img, grads);
+        return;
+    }
+
+    // One-off engine; callers blurring many frames should keep their own
+    BlurEngine* engine = create_blur_engine(sigma_blur);
+    if (!engine) return;
+    compute_image_gradients_with_engine(img, grads, engine);
+    free_blur_engine(engine);
+}
+
+void compute_image_gradients_with_engine(const Image* img, ImageGradients* grads, BlurEngine* engine) {
+    if (!engine->blurred || engine->blurred->height != img->height ||
+        engine->blurred->width != img->width || engine->blurred->channels != img->channels) {
+        free_image(engine->blurred);
+        engine->blurred = create_image(img->height, img->width, img->channels);
+        if (!engine->blurred) return;
+    }
+
+    if (!apply_gaussian_blur(engine, img, engine->blurred)) return;
+
+    // Compute Prewitt gradients
+    compute_prewitt_gradients(engine->blurred, grads);
+}
+
+BlurEngine* create_blur_engine(float sigma) {
+    BlurEngine* engine = (BlurEngine*)calloc(1, sizeof(BlurEngine));
+    if (!engine) return NULL;
+
+    if (!set_blur_engine_sigma(engine, sigma)) {
+        free_blur_engine(engine);
+        return NULL;
+    }
+    return engine;
+}
+
+void free_blur_engine(BlurEngine* engine) {
+    if (engine) {
+        free(engine->kernel);
+        free(engine->scratch);
+        free_image(engine->blurred);
+        free(engine);
+    }
+}
+
+bool set_blur_engine_sigma(BlurEngine* engine, float sigma) {
+    if (sigma <= 0) return false;
+    if (engine->kernel && engine->sigma == sigma) return true;
+
+    int radius = (int)(4 * sigma + 0.5);
+    float* kernel = (float*)malloc(sizeof(float) * (2 * radius + 1));
+    if (!kernel) return false;
+    compute_gaussian_kernel(kernel, 2 * radius + 1, sigma);
+
+    free(engine->kernel);
+    engine->kernel = kernel;
+    engine->radius = radius;
+    engine->sigma = sigma;
+    return true;
+}
+
+// Border samples use only the taps inside the image, renormalized
+static float blur_sample_clipped(const float* input, int stride, int size, int i,
+                                 const float* kernel, int radius) {
+    float sum = 0;
+    float weight_sum = 0;
+    for (int k = -radius; k <= radius; k++) {
+        int idx = i + k;
+        if (idx >= 0 && idx < size) {
+            sum += input[(size_t)idx * stride] * kernel[k + radius];
+            weight_sum += kernel[k + radius];
         }
+    }
+    return sum / weight_sum;
+}
 
-        // Horizontal blur
-        for (int y = 0; y < img->height; y++) {
-            gaussian_blur_1d(&img->data[y * img->width], &blurred_img->data[y * img->width], 
-                           img->width, sigma_blur);
+bool apply_gaussian_blur(BlurEngine* engine, const Image* src, Image* dst) {
+    int width = src->width;
+    int height = src->height;
+    int radius = engine->radius;
+    const float* kernel = engine->kernel;
+
+    size_t plane = (size_t)width * height;
+    if (engine->scratch_size < plane) {
+        float* scratch = (float*)realloc(engine->scratch, sizeof(float) * plane);
+        if (!scratch) return false;
+        engine->scratch = scratch;
+        engine->scratch_size = plane;
+    }
+    float* temp = engine->scratch;
+
+    // Interior range where every tap is in bounds
+    int x_lo = radius < width ? radius : width;
+    int x_hi = width - radius > x_lo ? width - radius : x_lo;
+    int y_lo = radius < height ? radius : height;
+    int y_hi = height - radius > y_lo ? height - radius : y_lo;
+
+    // Horizontal pass: one multiply-add sweep per tap over the row interior
+    for (int y = 0; y < height; y++) {
+        const float* in = &src->data[(size_t)y * src->pitch];
+        float* out = &temp[(size_t)y * width];
+
+        for (int x = x_lo; x < x_hi; x++) out[x] = 0;
+        for (int k = 0; k <= 2 * radius; k++) {
+            float w = kernel[k];
+            const float* shifted = in + k - radius;
+            for (int x = x_lo; x < x_hi; x++) out[x] += w * shifted[x];
         }
+        for (int x = 0; x < x_lo; x++) out[x] = blur_sample_clipped(in, 1, width, x, kernel, radius);
+        for (int x = x_hi; x < width; x++) out[x] = blur_sample_clipped(in, 1, width, x, kernel, radius);
+    }
 
-        // Vertical blur
-        for (int x = 0; x < img->width; x++) {
-            // Extract column
-            for (int y = 0; y < img->height; y++) {
-                temp[y] = blurred_img->data[y * img->width + x];
+    // Vertical pass, row-wise: each output row is a weighted sum of whole rows
+    for (int y = 0; y < height; y++) {
+        float* out = &dst->data[(size_t)y * dst->pitch];
+
+        if (y >= y_lo && y < y_hi) {
+            for (int x = 0; x < width; x++) out[x] = 0;
+            for (int k = 0; k <= 2 * radius; k++) {
+                float w = kernel[k];
+                const float* in = &temp[(size_t)(y + k - radius) * width];
+                for (int x = 0; x < width; x++) out[x] += w * in[x];
             }
-            // Blur column
-            gaussian_blur_1d(temp, temp, img->height, sigma_blur);
-            // Put back column
-            for (int y = 0; y < img->height; y++) {
-                blurred_img->data[y * img->width + x] = temp[y];
+        } else {
+            for (int x = 0; x < width; x++) {
+                out[x] = blur_sample_clipped(&temp[x], width, height, y, kernel, radius);
             }
         }
-
-        free(temp);
-        working_img = blurred_img;
     }
 
-    // Compute Prewitt gradients
-    compute_prewitt_gradients(working_img, grads);
-
-    if (blurred_img) {
-        free_image(blurred_img);
-    }
+    return true;
 }
 
 static void compute_prewitt_gradients(const Image* img, ImageGradients* grads) {
-    // Prewitt kernels
-    const float kernelx[3] = {-1, 0, 1};
-    const float kernely[3] = {-1, 0, 1};
+    // Prewitt kernels are [-1, 0, 1]. Samples outside the image count as zero,
+    // so edge rows and columns take their inside neighbor alone and the
+    // interior runs without bounds checks.
+    int width = img->width;
+    int height = img->height;
 
     // Compute horizontal gradients
-    for (int y = 0; y < img->height; y++) {
-        for (int x = 0; x < img->width; x++) {
-            float sum = 0;
-            for (int k = -1; k <= 1; k++) {
-                int xk = x + k;
-                if (xk >= 0 && xk < img->width) {
-                    sum += img->data[y * img->width + xk] * kernelx[k + 1];
-                }
-            }
-            grads->data_x[y * img->width + x] = sum;
+    for (int y = 0; y < height; y++) {
+        const pixel_t* in = &img->data[(size_t)y * img->pitch];
+        pixel_t* out = &grads->data_x[(size_t)y * width];
+        if (width == 1) {
+            out[0] = 0;
+            continue;
+        }
+        out[0] = in[1];
+        for (int x = 1; x < width - 1; x++) {
+            out[x] = in[x + 1] - in[x - 1];
         }
+        out[width - 1] = -in[width - 2];
     }
 
     // Compute vertical gradients
-    for (int y = 0; y < img->height; y++) {
-        for (int x = 0; x < img->width; x++) {
-            float sum = 0;
-            for (int k = -1; k <= 1; k++) {
-                int yk = y + k;
-                if (yk >= 0 && yk < img->height) {
-                    sum += img->data[yk * img->width + x] * kernely[k + 1];
-                }
-            }
-            grads->data_y[y * img->width + x] = sum;
+    for (int y = 0; y < height; y++) {
+        const pixel_t* up = y > 0 ? &img->data[(size_t)(y - 1) * img->pitch] : NULL;
+        const pixel_t* down = y < height - 1 ? &img->data[(size_t)(y + 1) * img->pitch] : NULL;
+        pixel_t* out = &grads->data_y[(size_t)y * width];
+        if (up && down) {
+            for (int x = 0; x < width; x++) out[x] = down[x] - up[x];
+        } else if (down) {
+            for (int x = 0; x < width; x++) out[x] = down[x];
+        } else if (up) {
+            for (int x = 0; x < width; x++) out[x] = -up[x];
+        } else {
+            for (int x = 0; x < width; x++) out[x] = 0;
         }
     }
 }
@@ -165,77 +287,234 @@ HessianMatrix* compute_hessian(const ImageGradients* grads, int tile_size) {
     return hessian;
 }
 
+HessianIntegral* init_hessian_integral(const ImageGradients* grads) {
+    HessianIntegral* integral = (HessianIntegral*)malloc(sizeof(HessianIntegral));
+    if (!integral) return NULL;
+
+    integral->height = grads->height;
+    integral->width = grads->width;
+    size_t stride = (size_t)grads->width + 1;
+    size_t size = stride * (grads->height + 1);
+    integral->gxx = (double*)malloc(sizeof(double) * size);
+    integral->gxy = (double*)malloc(sizeof(double) * size);
+    integral->gyy = (double*)malloc(sizeof(double) * size);
+    if (!integral->gxx || !integral->gxy || !integral->gyy) {
+        free_hessian_integral(integral);
+        return NULL;
+    }
+
+    // Zero first row; every later row starts with a zero column
+    memset(integral->gxx, 0, sizeof(double) * stride);
+    memset(integral->gxy, 0, sizeof(double) * stride);
+    memset(integral->gyy, 0, sizeof(double) * stride);
+
+    // One pass: running row sums plus the table row above
+    for (int y = 0; y < grads->height; y++) {
+        const pixel_t* gx_row = &grads->data_x[y * grads->width];
+        const pixel_t* gy_row = &grads->data_y[y * grads->width];
+        double* xx = &integral->gxx[(y + 1) * stride];
+        double* xy = &integral->gxy[(y + 1) * stride];
+        double* yy = &integral->gyy[(y + 1) * stride];
+        double row_xx = 0, row_xy = 0, row_yy = 0;
+
+        xx[0] = xy[0] = yy[0] = 0;
+        for (int x = 0; x < grads->width; x++) {
+            double gx = gx_row[x];
+            double gy = gy_row[x];
+            row_xx += gx * gx;
+            row_xy += gx * gy;
+            row_yy += gy * gy;
+            xx[x + 1] = xx[x + 1 - stride] + row_xx;
+            xy[x + 1] = xy[x + 1 - stride] + row_xy;
+            yy[x + 1] = yy[x + 1 - stride] + row_yy;
+        }
+    }
+
+    return integral;
+}
+
+void hessian_from_integral(const HessianIntegral* integral, int x0, int y0,
+                           int width, int height, float* H) {
+    // Clip the rectangle to the image
+    int x1 = x0 + width;
+    int y1 = y0 + height;
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > integral->width) x1 = integral->width;
+    if (y1 > integral->height) y1 = integral->height;
+    if (x1 <= x0 || y1 <= y0) {
+        H[0] = H[1] = H[2] = H[3] = 0;
+        return;
+    }
+
+    size_t stride = (size_t)integral->width + 1;
+    size_t a = y0 * stride + x0;
+    size_t b = y0 * stride + x1;
+    size_t c = y1 * stride + x0;
+    size_t d = y1 * stride + x1;
+
+    float h01 = (float)(integral->gxy[d] - integral->gxy[b] - integral->gxy[c] + integral->gxy[a]);
+    H[0] = (float)(integral->gxx[d] - integral->gxx[b] - integral->gxx[c] + integral->gxx[a]);
+    H[1] = h01;
+    H[2] = h01;
+    H[3] = (float)(integral->gyy[d] - integral->gyy[b] - integral->gyy[c] + integral->gyy[a]);
+}
+
+HessianMatrix* compute_hessian_integral(const HessianIntegral* integral, int tile_size, int tile_step) {
+    if (tile_size <= 0 || tile_step <= 0) return NULL;
+
+    int n_patches_y = (integral->height + tile_step - 1) / tile_step;
+    int n_patches_x = (integral->width + tile_step - 1) / tile_step;
+
+    HessianMatrix* hessian = (HessianMatrix*)malloc(sizeof(HessianMatrix));
+    if (!hessian) return NULL;
+
+    hessian->height = n_patches_y;
+    hessian->width = n_patches_x;
+    hessian->data = (float*)malloc(sizeof(float) * n_patches_y * n_patches_x * 4);
+    if (!hessian->data) {
+        free(hessian);
+        return NULL;
+    }
+
+    for (int py = 0; py < n_patches_y; py++) {
+        for (int px = 0; px < n_patches_x; px++) {
+            hessian_from_integral(integral, px * tile_step, py * tile_step, tile_size, tile_size,
+                                  &hessian->data[(py * n_patches_x + px) * 4]);
+        }
+    }
+
+    return hessian;
+}
+
+// Shared state for refining rows of patches in parallel
+typedef struct {
+    const Image* ref_img;
+    const Image* alt_img;
+    const ImageGradients* grads;
+    const HessianMatrix* hessian;
+    AlignmentMap* alignment;
+    const ICAParams* params;
+} ICARefineJob;
+
+// b -= g * (warped - ref) over one patch row. The whole patch shares one
+// displacement, so the bilinear weights are constant and each row is a
+// contiguous multiply-add the compiler vectorizes 8 or 16 pixels at a time.
+static void accumulate_patch_row(const float* alt0, const float* alt1, const float* ref,
+                                 const float* gx, const float* gy, int n,
+                                 float w00, float w10, float w01, float w11, float* b) {
+    float b0 = 0, b1 = 0;
+    for (int i = 0; i < n; i++) {
+        float warped_val = w00 * alt0[i] + w10 * alt0[i + 1] + w01 * alt1[i] + w11 * alt1[i + 1];
+        float dt = warped_val - ref[i];
+        b0 -= gx[i] * dt;
+        b1 -= gy[i] * dt;
+    }
+    b[0] += b0;
+    b[1] += b1;
+}
+
+// Run every iteration for one patch. Patches never read each other's
+// alignment, so this matches iterating over all patches per iteration.
+static void refine_patch(const ICARefineJob* job, int py, int px) {
+    const Image* ref_img = job->ref_img;
+    const Image* alt_img = job->alt_img;
+    const ImageGradients* grads = job->grads;
+    const HessianMatrix* hessian = job->hessian;
+    int tile_size = job->params->tile_size;
+    int patch_start_y = py * tile_size;
+    int patch_start_x = px * tile_size;
+    int patch_end_y = patch_start_y + tile_size < ref_img->height ? patch_start_y + tile_size : ref_img->height;
+    int patch_end_x = patch_start_x + tile_size < ref_img->width ? patch_start_x + tile_size : ref_img->width;
+    int hidx = (py * hessian->width + px) * 4;
+
+    // Skip if Hessian is singular
+    float det = hessian->data[hidx] * hessian->data[hidx + 3] -
+              hessian->data[hidx + 1] * hessian->data[hidx + 2];
+    if (fabs(det) < 1e-10) return;
+
+    // Current alignment for this patch
+    Alignment* curr_align = &job->alignment->data[py * job->alignment->width + px];
+
+    for (int iter = 0; iter < job->params->num_iterations; iter++) {
+        float b[2] = {0, 0};  // Right-hand side of the system
+        float ax = curr_align->x;
+        float ay = curr_align->y;
+
+        // Columns whose warped position stays inside [0, width - 1)
+        int x_start = patch_start_x;
+        int x_end = patch_end_x;
+        while (x_start < x_end && (x_start + ax < 0 || x_start + ax >= alt_img->width - 1)) x_start++;
+        while (x_end > x_start && (x_end - 1 + ax < 0 || x_end - 1 + ax >= alt_img->width - 1)) x_end--;
+
+        if (x_start < x_end) {
+            float floor_x = floorf(ax);
+            float floor_y = floorf(ay);
+            float dx = ax - floor_x;
+            float dy = ay - floor_y;
+            float w00 = (1 - dx) * (1 - dy);
+            float w10 = dx * (1 - dy);
+            float w01 = (1 - dx) * dy;
+            float w11 = dx * dy;
+            int x0 = x_start + (int)floor_x;
+
+            // Accumulate gradient differences over patch
+            for (int ref_y = patch_start_y; ref_y < patch_end_y; ref_y++) {
+                float warped_y = ref_y + ay;
+                if (warped_y < 0 || warped_y >= alt_img->height - 1) continue;
+                int y0 = ref_y + (int)floor_y;
+
+                const float* alt0 = &alt_img->data[(size_t)y0 * alt_img->pitch + x0];
+                int grad_idx = ref_y * grads->width + x_start;
+                accumulate_patch_row(alt0, alt0 + alt_img->pitch,
+                                     &ref_img->data[(size_t)ref_y * ref_img->pitch + x_start],
+                                     &grads->data_x[grad_idx], &grads->data_y[grad_idx],
+                                     x_end - x_start, w00, w10, w01, w11, b);
+            }
+        }
+
+        // Solve 2x2 system
+        float delta[2];
+        solve_2x2_system(&hessian->data[hidx], b, delta);
+
+        // Update alignment
+        curr_align->x += delta[0];
+        curr_align->y += delta[1];
+    }
+}
+
+static void refine_patch_row(void* ctx, int py) {
+    const ICARefineJob* job = (const ICARefineJob*)ctx;
+    for (int px = 0; px < job->alignment->width; px++) {
+        refine_patch(job, py, px);
+    }
+}
+
 AlignmentMap* refine_alignment_ica(const Image* ref_img, const Image* alt_img,
                                 const ImageGradients* grads,
                                 const HessianMatrix* hessian,
                                 const AlignmentMap* initial_alignment,
                                 const ICAParams* params) {
+    if (!is_single_plane(ref_img) || !is_single_plane(alt_img)) return NULL;
+    if (!hessian_matches_tiles(hessian, grads, initial_alignment, params->tile_size)) return NULL;
+    PROF_SCOPE(PROF_STAGE_ICA);
+
     // Create a copy of initial alignment to refine
     AlignmentMap* current_alignment = create_alignment_map(initial_alignment->height, initial_alignment->width);
     if (!current_alignment) return NULL;
     memcpy(current_alignment->data, initial_alignment->data, 
            sizeof(Alignment) * initial_alignment->height * initial_alignment->width);
 
-    // Iterate to refine alignment
-    for (int iter = 0; iter < params->num_iterations; iter++) {
-        // For each patch
-        for (int py = 0; py < current_alignment->height; py++) {
-            for (int px = 0; px < current_alignment->width; px++) {
-                float b[2] = {0, 0};  // Right-hand side of the system
-                int patch_start_y = py * params->tile_size;
-                int patch_start_x = px * params->tile_size;
-                int hidx = (py * hessian->width + px) * 4;
-
-                // Skip if Hessian is singular
-                float det = hessian->data[hidx] * hessian->data[hidx + 3] - 
-                          hessian->data[hidx + 1] * hessian->data[hidx + 2];
-                if (fabs(det) < 1e-10) continue;
-
-                // Current alignment for this patch
-                Alignment* curr_align = &current_alignment->data[py * current_alignment->width + px];
-
-                // Accumulate gradient differences over patch
-                for (int y = 0; y < params->tile_size; y++) {
-                    int ref_y = patch_start_y + y;
-                    if (ref_y >= ref_img->height) break;
-
-                    for (int x = 0; x < params->tile_size; x++) {
-                        int ref_x = patch_start_x + x;
-                        if (ref_x >= ref_img->width) break;
-
-                        // Compute warped position
-                        float warped_x = ref_x + curr_align->x;
-                        float warped_y = ref_y + curr_align->y;
-
-                        // Skip if outside image bounds
-                        if (warped_x < 0 || warped_x >= alt_img->width - 1 ||
-                            warped_y < 0 || warped_y >= alt_img->height - 1) continue;
-
-                        // Get interpolated value from alternate image
-                        float warped_val;
-                        bilinear_interpolation(alt_img, warped_x, warped_y, &warped_val);
-
-                        // Compute temporal gradient
-                        float ref_val = ref_img->data[ref_y * ref_img->width + ref_x];
-                        float dt = warped_val - ref_val;
-
-                        // Update b vector
-                        int grad_idx = ref_y * grads->width + ref_x;
-                        b[0] += -grads->data_x[grad_idx] * dt;
-                        b[1] += -grads->data_y[grad_idx] * dt;
-                    }
-                }
-
-                // Solve 2x2 system
-                float delta[2];
-                solve_2x2_system(&hessian->data[hidx], b, delta);
-
-                // Update alignment
-                curr_align->x += delta[0];
-                curr_align->y += delta[1];
-            }
-        }
-    }
+    ICARefineJob job = {
+        .ref_img = ref_img,
+        .alt_img = alt_img,
+        .grads = grads,
+        .hessian = hessian,
+        .alignment = current_alignment,
+        .params = params,
+    };
+    thread_pool_parallel_for(params->thread_pool, current_alignment->height, refine_patch_row, &job);
+    PROF_COUNT(PROF_COUNTER_ICA_PATCHES, current_alignment->height * current_alignment->width);
 
     return current_alignment;
 }
@@ -252,33 +531,6 @@ void solve_2x2_system(const float* A, const float* b, float* x) {
     x[1] = (-A[2] * b[0] + A[0] * b[1]) * inv_det;
 }
 
-static void gaussian_blur_1d(const float* input, float* output, int size, float sigma) {
-    int radius = (int)(4 * sigma + 0.5);
-    float* kernel = (float*)malloc(sizeof(float) * (2 * radius + 1));
-    if (!kernel) return;
-
-    compute_gaussian_kernel(kernel, 2 * radius + 1, sigma);
-
-    // Apply convolution
-    for (int i = 0; i < size; i++) {
-        float sum = 0;
-        float weight_sum = 0;
-
-        for (int k = -radius; k <= radius; k++) {
-            int idx = i + k;
-            if (idx >= 0 && idx < size) {
-                float weight = kernel[k + radius];
-                sum += input[idx] * weight;
-                weight_sum += weight;
-            }
-        }
-
-        output[i] = sum / weight_sum;
-    }
-
-    free(kernel);
-}
-
 static void compute_gaussian_kernel(float* kernel, int size, float sigma) {
     int radius = size / 2;
     float sum = 0;
@@ -295,26 +547,6 @@ static void compute_gaussian_kernel(float* kernel, int size, float sigma) {
     }
 }
 
-static void bilinear_interpolation(const Image* img, float x, float y, float* result) {
-    int x0 = (int)floorf(x);
-    int y0 = (int)floorf(y);
-    int x1 = x0 + 1;
-    int y1 = y0 + 1;
-
-    float dx = x - x0;
-    float dy = y - y0;
-
-    float v00 = img->data[y0 * img->width + x0];
-    float v10 = img->data[y0 * img->width + x1];
-    float v01 = img->data[y1 * img->width + x0];
-    float v11 = img->data[y1 * img->width + x1];
-
-    *result = (1 - dx) * (1 - dy) * v00 +
-              dx * (1 - dy) * v10 +
-              (1 - dx) * dy * v01 +
-              dx * dy * v11;
-}
-
 void free_image_gradients(ImageGradients* grads) {
     if (grads) {
         free(grads->data_x);
@@ -323,6 +555,15 @@ void free_image_gradients(ImageGradients* grads) {
     }
 }
 
+void free_hessian_integral(HessianIntegral* integral) {
+    if (integral) {
+        free(integral->gxx);
+        free(integral->gxy);
+        free(integral->gyy);
+        free(integral);
+    }
+}
+
 void free_hessian_matrix(HessianMatrix* hessian) {
     if (hessian) {
         free(hessian->data);
@@ -22,28 +22,73 @@ typedef struct {
     int width;        // Number of patches in x direction
 } HessianMatrix;
 
+// Summed-area tables of gx*gx, gx*gy and gy*gy, each (height+1) x (width+1)
+// with a zero first row and column. Doubles keep tile sums exact enough on
+// large frames, where float prefix sums would cancel catastrophically.
+typedef struct {
+    double* gxx;
+    double* gxy;
+    double* gyy;
+    int height;       // Image height (tables have height + 1 rows)
+    int width;        // Image width (tables have width + 1 columns)
+} HessianIntegral;
+
+// Separable Gaussian blur with the kernel computed once per sigma and
+// scratch planes kept across calls and frames
+typedef struct {
+    float sigma;
+    int radius;
+    float* kernel;        // 2 * radius + 1 normalized taps
+    float* scratch;       // Horizontally blurred plane
+    size_t scratch_size;
+    Image* blurred;       // Output reused by compute_image_gradients_with_engine
+} BlurEngine;
+
 // Parameters structure for ICA
 typedef struct {
     float sigma_blur;     // Gaussian blur sigma (0 means no blur)
     int num_iterations;   // Number of Kanade iterations
     int tile_size;       // Size of tiles for patch-wise alignment
+    BlurEngine* blur_engine;  // Optional, not owned; reused across frames when set
+    ThreadPool* thread_pool;  // Optional, not owned; refines patch rows in parallel
 } ICAParams;
 
 // Function declarations
+// ICA works on one plane: images must have one channel (either layout). Color
+// frames are refined on their alignment plane, e.g. the luma the frame buffer
+// keeps per frame (see frame_buffer_alignment_image).
 ImageGradients* init_ica(const Image* ref_img, const ICAParams* params);
 void free_image_gradients(ImageGradients* grads);
 HessianMatrix* compute_hessian(const ImageGradients* grads, int tile_size);
 void free_hessian_matrix(HessianMatrix* hessian);
 
-// Main ICA function
+// Integral-image Hessians: build the tables once, then any rectangle costs O(1)
+HessianIntegral* init_hessian_integral(const ImageGradients* grads);
+void free_hessian_integral(HessianIntegral* integral);
+void hessian_from_integral(const HessianIntegral* integral, int x0, int y0,
+                           int width, int height, float* H);
+// Patches of tile_size placed every tile_step pixels (tile_step < tile_size
+// overlaps them); patches are clipped at the image border like compute_hessian.
+// Only tile_step == tile_size gives the layout refine_alignment_ica accepts.
+HessianMatrix* compute_hessian_integral(const HessianIntegral* integral, int tile_size, int tile_step);
+
+// Main ICA function. The Hessian must hold one patch per params->tile_size
+// tile of the gradients, as compute_hessian builds it; NULL otherwise.
 AlignmentMap* refine_alignment_ica(const Image* ref_img, const Image* alt_img,
                                  const ImageGradients* grads,
                                  const HessianMatrix* hessian,
                                  const AlignmentMap* initial_alignment,
                                  const ICAParams* params);
 
+// Blur engine
+BlurEngine* create_blur_engine(float sigma);
+void free_blur_engine(BlurEngine* engine);
+bool set_blur_engine_sigma(BlurEngine* engine, float sigma);
+bool apply_gaussian_blur(BlurEngine* engine, const Image* src, Image* dst);
+
 // Utility functions
 void compute_image_gradients(const Image* img, ImageGradients* grads, float sigma_blur);
+void compute_image_gradients_with_engine(const Image* img, ImageGradients* grads, BlurEngine* engine);
 void solve_2x2_system(const float* A, const float* b, float* x);
 
 #endif // ICA_H
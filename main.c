@@ -1,11 +1,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "block_matching.h"
 #include "ica.h"
 #include "utils.h"
 #include "video_denoising.h"
 #include "warp.h"
+#include "profiler.h"
+#include "pipeline.h"
+#include "frame_pool.h"
+#include "video_io.h"
 
 // Add these function declarations at the top of the file with the other includes
 // Image* load_next_frame(void);  // Declare return type as Image*
@@ -42,6 +47,26 @@ int main(int argc, char* argv[]) {
     if (argc < 4) {
         printf("Usage: %s <input_pattern> <output_pattern> <num_frames> [options]\n", argv[0]);
         printf("Example: %s frame_%%04d.png denoised_%%04d.png 100\n", argv[0]);
+        printf("         %s - - 0 < noisy.y4m > denoised.y4m\n", argv[0]);
+        printf("\nInput and output may instead be .y4m or raw .yuv videos, or - for stdin and\n");
+        printf("stdout (Y4M, or raw with --size). num_frames 0 reads the whole video.\n");
+        printf("\nOptions:\n");
+        printf("  --profile               Print per-stage timings when done\n");
+        printf("  --profile-json FILE     Write per-frame and aggregate timings as JSON\n");
+        printf("  --flow-cache            Compose cached adjacent-frame flows instead of searching\n");
+        printf("  --temporal-prior        Start each search from the previous frame's flow\n");
+        printf("  --luma-align            Search on luma (Y of videos) only, then warp every channel\n");
+        printf("  --ica N                 Refine flows with N ICA iterations on luma (implies --luma-align)\n");
+        printf("  --pixel-format FMT      Block matching samples: float, u8 or u16 (default: float)\n");
+        printf("  --search S              Block matching search: exhaustive, small-diamond, large-diamond,\n");
+        printf("                          hexagon or epzs (default: exhaustive)\n");
+        printf("  --subpixel              Fit each block match to a fraction of a pixel\n");
+        printf("  --planar                Keep frames in planar (one plane per channel) layout\n");
+        printf("  --size WxH              Frame size of raw video input\n");
+        printf("  --chroma FMT            Raw video planes: gray, 420 or 444 (default: 420)\n");
+        printf("  --raw-float             Raw video samples are 32-bit floats in [0, 1]\n");
+        printf("  --png-level N           PNG zlib level, 0 (store) to 9 (default: %d)\n", PNG_DEFAULT_LEVEL);
+        printf("  --encode-threads N      PNG frames encoded at once (default: one per CPU)\n");
         return 1;
     }
 
@@ -49,70 +74,234 @@ int main(int argc, char* argv[]) {
     const char* output_pattern = argv[2];
     int num_frames = atoi(argv[3]);
 
+    bool print_profile = false;
+    const char* profile_json = NULL;
+    bool flow_cache = false;
+    bool temporal_prior = false;
+    bool luma_align = false;
+    int ica_iterations = 0;
+    PixelFormat pixel_format = PIXEL_FORMAT_FLOAT;
+    SearchStrategy search_strategy = SEARCH_EXHAUSTIVE;
+    bool subpixel = false;
+    ImageLayout layout = IMAGE_LAYOUT_INTERLEAVED;
+    VideoFormat raw_format = {.container = VIDEO_CONTAINER_RAW, .chroma = VIDEO_CHROMA_420};
+    int png_level = PNG_DEFAULT_LEVEL;
+    int encode_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "--profile") == 0) {
+            print_profile = true;
+        } else if (strcmp(argv[i], "--profile-json") == 0 && i + 1 < argc) {
+            profile_json = argv[++i];
+        } else if (strcmp(argv[i], "--flow-cache") == 0) {
+            flow_cache = true;
+        } else if (strcmp(argv[i], "--temporal-prior") == 0) {
+            temporal_prior = true;
+        } else if (strcmp(argv[i], "--luma-align") == 0) {
+            luma_align = true;
+        } else if (strcmp(argv[i], "--ica") == 0 && i + 1 < argc) {
+            ica_iterations = atoi(argv[++i]);
+            if (ica_iterations < 1) {
+                fprintf(stderr, "ICA needs at least one iteration\n");
+                return 1;
+            }
+            luma_align = true;  // ICA refines on one plane
+        } else if (strcmp(argv[i], "--planar") == 0) {
+            layout = IMAGE_LAYOUT_PLANAR;
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            i++;
+            if (sscanf(argv[i], "%dx%d", &raw_format.width, &raw_format.height) != 2 ||
+                raw_format.width <= 0 || raw_format.height <= 0) {
+                fprintf(stderr, "Invalid frame size %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--png-level") == 0 && i + 1 < argc) {
+            png_level = atoi(argv[++i]);
+            if (png_level < 0 || png_level > 9) {
+                fprintf(stderr, "PNG level must be between 0 and 9\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--encode-threads") == 0 && i + 1 < argc) {
+            encode_threads = atoi(argv[++i]);
+            if (encode_threads < 1) {
+                fprintf(stderr, "Need at least one encode thread\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--raw-float") == 0) {
+            raw_format.sample_type = VIDEO_SAMPLE_F32;
+        } else if (strcmp(argv[i], "--chroma") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "gray") == 0) {
+                raw_format.chroma = VIDEO_CHROMA_MONO;
+            } else if (strcmp(argv[i], "444") == 0) {
+                raw_format.chroma = VIDEO_CHROMA_444;
+            } else if (strcmp(argv[i], "420") != 0) {
+                fprintf(stderr, "Unknown chroma format %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--pixel-format") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "u8") == 0) {
+                pixel_format = PIXEL_FORMAT_U8;
+            } else if (strcmp(argv[i], "u16") == 0) {
+                pixel_format = PIXEL_FORMAT_U16;
+            } else if (strcmp(argv[i], "float") != 0) {
+                fprintf(stderr, "Unknown pixel format %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--subpixel") == 0) {
+            subpixel = true;
+        } else if (strcmp(argv[i], "--search") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "small-diamond") == 0) {
+                search_strategy = SEARCH_SMALL_DIAMOND;
+            } else if (strcmp(argv[i], "large-diamond") == 0) {
+                search_strategy = SEARCH_LARGE_DIAMOND;
+            } else if (strcmp(argv[i], "hexagon") == 0) {
+                search_strategy = SEARCH_HEXAGON;
+            } else if (strcmp(argv[i], "epzs") == 0) {
+                search_strategy = SEARCH_EPZS;
+            } else if (strcmp(argv[i], "exhaustive") != 0) {
+                fprintf(stderr, "Unknown search strategy %s\n", argv[i]);
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    // Recycle frame-sized buffers and search scratch so the steady state
+    // does not go back to malloc (either may be NULL, which just allocates)
+    ImagePool* image_pool = create_image_pool();
+    FrameArena* arena = create_frame_arena(0);
+
+    // Video streams replace the image patterns on both ends. They are opened
+    // before anything is logged, which moves off stdout when it is the output.
+    VideoReader* reader = NULL;
+    VideoWriter* writer = NULL;
+    bool stream_in = is_video_stream_path(input_pattern);
+    if (stream_in != is_video_stream_path(output_pattern)) {
+        fprintf(stderr, "Input and output must both be videos or both be image patterns\n");
+        free_image_pool(image_pool);
+        free_frame_arena(arena);
+        return 1;
+    }
+    if (stream_in) {
+        bool raw = raw_format.width > 0;
+        raw_format.container = video_container_for_path(input_pattern,
+                                                        raw ? VIDEO_CONTAINER_RAW : VIDEO_CONTAINER_Y4M);
+        reader = create_video_reader(input_pattern, &raw_format, image_pool, layout, 1);  // Border as below
+        if (reader) {
+            VideoFormat out_format = *video_reader_format(reader);
+            out_format.container = video_container_for_path(output_pattern, out_format.container);
+            writer = create_video_writer(output_pattern, &out_format);
+        }
+        if (!reader || !writer) {
+            free_video_reader(reader);
+            free_image_pool(image_pool);
+            free_frame_arena(arena);
+            return 1;
+        }
+    }
+
     // Initialize denoising parameters
     DenoisingParams denoise_params = {
         .temporal_radius = 2,    // Use 5 frames total
         .noise_level = 20.0f,    // Adjust based on your video
         .block_size = 16,
-        .search_radius = 16
+        .search_radius = 16,
+        .num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN),
+        .flow_refine_radius = 2, // Only used with the flow cache
+        .temporal_prior = temporal_prior,
+        .prior_radius = 2,       // Where the previous flow is locally steady
+        .pixel_format = pixel_format,
+        .search_strategy = search_strategy,
+        .subpixel = subpixel,
+        .ica_iterations = ica_iterations
     };
     
     // Create frame buffer
     FrameBuffer* buffer = create_frame_buffer(2 * denoise_params.temporal_radius + 1);
     if (!buffer) {
         fprintf(stderr, "Failed to create frame buffer\n");
+        free_video_reader(reader);
+        free_video_writer(writer);
+        free_image_pool(image_pool);
+        free_frame_arena(arena);
         return 1;
     }
 
-    // Process frames
-    for (int frame_idx = 0; frame_idx < num_frames; frame_idx++) {
-        Image* frame = load_next_frame(input_pattern, frame_idx);
-        if (!frame) {
-            fprintf(stderr, "Failed to load frame %d\n", frame_idx);
-            continue;
-        }
+    // Build each frame's pyramid once as it enters the buffer
+    BlockMatchingParams* bm_params = create_denoising_bm_params(&denoise_params);
+    if (!bm_params) {
+        fprintf(stderr, "Failed to create block matching parameters\n");
+        free_frame_buffer(buffer);
+        free_video_reader(reader);
+        free_video_writer(writer);
+        free_image_pool(image_pool);
+        free_frame_arena(arena);
+        return 1;
+    }
+    set_frame_buffer_pyramid_params(buffer, bm_params);
+    set_frame_buffer_flow_cache(buffer, flow_cache);
+    if (luma_align) {
+        // Video frames are YUV and carry luma in their first plane; images are RGB(A)
+        set_frame_buffer_alignment_plane(buffer, stream_in ? ALIGN_PLANE_FIRST : ALIGN_PLANE_LUMA);
+    }
 
-        if (add_frame_to_buffer(buffer, frame) != 0) {
-            fprintf(stderr, "Failed to add frame %d to buffer\n", frame_idx);
-            free_image(frame);
-            continue;
-        }
+    // Search scratch comes from the arena
+    bm_params->arena = arena;
 
-        // Once we have enough frames in the buffer, denoise the center frame
-        if (buffer->size == buffer->capacity) {
-            Image* denoised = denoise_frame(buffer, &denoise_params);
-            if (denoised) {
-                char output_filename[256];
-                snprintf(output_filename, sizeof(output_filename), output_pattern, 
-                        frame_idx - denoise_params.temporal_radius);
-                if (!save_image(output_filename, denoised)) {
-                    fprintf(stderr, "Failed to save denoised frame %d\n", 
-                            frame_idx - denoise_params.temporal_radius);
-                }
-                free_image(denoised);
-            }
-        }
-        
-        free_image(frame);
+    // Decode, denoise and encode overlap; the queues bound how far decode runs ahead
+    PipelineConfig pipeline = {
+        .input_pattern = input_pattern,
+        .output_pattern = output_pattern,
+        .reader = reader,
+        .writer = writer,
+        .num_frames = num_frames,
+        .prefetch_depth = 4,
+        .encode_depth = 4,
+        .encode_threads = encode_threads,
+        .png_level = png_level,
+        .layout = layout,
+        .border = 1,             // Lets warping read past the last row and column unchecked
+        .image_pool = image_pool
+    };
+    int frames_written = run_denoising_pipeline(&pipeline, buffer, &denoise_params);
+    if (frames_written < 0) {
+        fprintf(stderr, "Failed to start the denoising pipeline\n");
     }
 
-    // Process remaining frames in buffer
-    while (buffer->size > 0) {
-        Image* denoised = denoise_frame(buffer, &denoise_params);
-        if (denoised) {
-            char output_filename[256];
-            snprintf(output_filename, sizeof(output_filename), output_pattern, 
-                    num_frames - buffer->size);
-            if (!save_image(output_filename, denoised)) {
-                fprintf(stderr, "Failed to save final denoised frame %d\n", 
-                        num_frames - buffer->size);
-            }
-            free_image(denoised);
+    if (print_profile) {
+        prof_report_text(stdout);
+    }
+    if (profile_json) {
+        FILE* f = fopen(profile_json, "w");
+        if (f) {
+            prof_report_json(f);
+            fclose(f);
+        } else {
+            fprintf(stderr, "Failed to write profile to %s\n", profile_json);
         }
     }
 
-    // Cleanup
+    // Cleanup (pooled images go back to the pool before it is freed). The
+    // profiler is shut down once the block matching workers have been joined.
     free_frame_buffer(buffer);
-    printf("Video denoising completed!\n");
+    free_block_matching_params(bm_params);
+    prof_shutdown();
+    free_image_pool(image_pool);
+    free_frame_arena(arena);
+    free_video_reader(reader);
+    if (writer && !free_video_writer(writer)) {
+        fprintf(stderr, "Failed to finish writing %s\n", output_pattern);
+        return 1;
+    }
+    if (frames_written < 0) return 1;
+    if (frames_written == 0) {
+        fprintf(stderr, "No frames were denoised from %s\n", input_pattern);
+        return 1;
+    }
+    printf("Video denoising completed: %d frames written\n", frames_written);
     return 0;
 }
@@ -0,0 +1,306 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "pipeline.h"
+#include "utils.h"
+#include "profiler.h"
+#include "frame_pool.h"
+
+// Bounded blocking queue of frames, each with an optional alignment plane;
+// push waits while full, pop while empty
+typedef struct {
+    Image** images;
+    Image** planes;
+    int* indices;
+    int capacity;
+    int head;
+    int count;
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} FrameQueue;
+
+static bool init_frame_queue(FrameQueue* queue, int capacity) {
+    if (capacity < 1) capacity = 1;
+    queue->images = (Image**)malloc(sizeof(Image*) * capacity);
+    queue->planes = (Image**)malloc(sizeof(Image*) * capacity);
+    queue->indices = (int*)malloc(sizeof(int) * capacity);
+    if (!queue->images || !queue->planes || !queue->indices) {
+        free(queue->images);
+        free(queue->planes);
+        free(queue->indices);
+        return false;
+    }
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    queue->closed = false;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    return true;
+}
+
+static void destroy_frame_queue(FrameQueue* queue) {
+    // Anything still queued was never consumed
+    for (int i = 0; i < queue->count; i++) {
+        free_image(queue->images[(queue->head + i) % queue->capacity]);
+        free_image(queue->planes[(queue->head + i) % queue->capacity]);
+    }
+    pthread_cond_destroy(&queue->not_full);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->images);
+    free(queue->planes);
+    free(queue->indices);
+}
+
+// Returns false if the queue was closed before the frame could be queued
+static bool frame_queue_push(FrameQueue* queue, Image* image, Image* plane, int index) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->capacity && !queue->closed) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    if (queue->closed) {
+        pthread_mutex_unlock(&queue->lock);
+        return false;
+    }
+    int tail = (queue->head + queue->count) % queue->capacity;
+    queue->images[tail] = image;
+    queue->planes[tail] = plane;
+    queue->indices[tail] = index;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+    return true;
+}
+
+// Returns false once the queue is closed and drained
+static bool frame_queue_pop(FrameQueue* queue, Image** image, Image** plane, int* index) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    if (queue->count == 0) {
+        pthread_mutex_unlock(&queue->lock);
+        return false;
+    }
+    *image = queue->images[queue->head];
+    *plane = queue->planes[queue->head];
+    *index = queue->indices[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+    return true;
+}
+
+// No more pushes; wakes every waiter
+static void frame_queue_close(FrameQueue* queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = true;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+typedef struct {
+    const PipelineConfig* config;
+    FrameQueue decoded;
+    FrameQueue denoised;
+    bool decode_luma;              // Decode each image's luma with it for the alignment plane
+    int frames_written;
+    pthread_mutex_t written_lock;  // Encoders finish frames concurrently
+} PipelineState;
+
+static void* decode_stage(void* arg) {
+    PipelineState* state = (PipelineState*)arg;
+
+    const PipelineConfig* config = state->config;
+    for (int frame_idx = 0; frame_idx < config->num_frames || (config->reader && config->num_frames <= 0);
+         frame_idx++) {
+        // A stream reader already produces pooled frames in the configured layout
+        if (config->reader) {
+            Image* frame = read_video_frame(config->reader);
+            if (!frame) break;
+            if (!frame_queue_push(&state->decoded, frame, NULL, frame_idx)) {
+                free_image(frame);
+                break;
+            }
+            continue;
+        }
+
+        // Everything derived from a pooled frame (pyramids, warps, the
+        // denoised output) is drawn from and returned to the same pool. The
+        // luma is taken in the same pass, while each decoded row is in cache.
+        char frame_path[256];
+        snprintf(frame_path, sizeof(frame_path), config->input_pattern, frame_idx);
+        Image* luma = NULL;
+        Image* frame = load_image_pooled(frame_path, config->image_pool, config->layout, config->border,
+                                         state->decode_luma ? &luma : NULL);
+        if (!frame) {
+            fprintf(stderr, "Failed to load frame %d\n", frame_idx);
+            continue;
+        }
+        if (!frame_queue_push(&state->decoded, frame, luma, frame_idx)) {
+            free_image(frame);
+            free_image(luma);
+            break;
+        }
+    }
+
+    frame_queue_close(&state->decoded);
+    return NULL;
+}
+
+static void* encode_stage(void* arg) {
+    PipelineState* state = (PipelineState*)arg;
+    Image* denoised;
+    Image* unused_plane;
+    int frame_idx;
+
+    while (frame_queue_pop(&state->denoised, &denoised, &unused_plane, &frame_idx)) {
+        bool saved;
+        if (state->config->writer) {
+            // Only one encoder runs with a stream, so frames stay in order
+            saved = write_video_frame(state->config->writer, denoised);
+        } else {
+            char output_filename[256];
+            snprintf(output_filename, sizeof(output_filename), state->config->output_pattern, frame_idx);
+            saved = save_image_png(output_filename, denoised, state->config->png_level);
+        }
+        if (saved) {
+            pthread_mutex_lock(&state->written_lock);
+            state->frames_written++;
+            pthread_mutex_unlock(&state->written_lock);
+        } else {
+            fprintf(stderr, "Failed to save denoised frame %d\n", frame_idx);
+        }
+        free_image(denoised);
+    }
+    return NULL;
+}
+
+// Denoise the buffered frame `age` frames behind the newest and queue it for
+// encoding under its input index. Each denoised frame closes a profiler
+// record under that index; stages overlap, so a record holds whatever
+// finished since the last one.
+static void denoise_and_queue(PipelineState* state, FrameBuffer* buffer, const DenoisingParams* params,
+                              const int* slot_indices, int age) {
+    int center_slot = (buffer->current - 1 - age + buffer->capacity) % buffer->capacity;
+    Image* denoised = denoise_buffered_frame(buffer, params, age);
+    if (!denoised) {
+        fprintf(stderr, "Failed to denoise frame %d\n", slot_indices[center_slot]);
+        return;
+    }
+    if (!frame_queue_push(&state->denoised, denoised, NULL, slot_indices[center_slot])) {
+        free_image(denoised);
+    }
+    prof_frame_end(slot_indices[center_slot]);
+}
+
+int run_denoising_pipeline(const PipelineConfig* config, FrameBuffer* buffer,
+                           const DenoisingParams* params) {
+    PipelineState state = {
+        .config = config,
+        .decode_luma = buffer->alignment_plane == ALIGN_PLANE_LUMA,
+        .frames_written = 0
+    };
+
+    // Input index of each buffer slot, to name the output after its center frame
+    int* slot_indices = (int*)malloc(sizeof(int) * buffer->capacity);
+    if (!slot_indices) return -1;
+
+    int num_encoders = config->writer || config->encode_threads < 1 ? 1 : config->encode_threads;
+    pthread_t* encoders = (pthread_t*)malloc(sizeof(pthread_t) * num_encoders);
+    if (!encoders) {
+        free(slot_indices);
+        return -1;
+    }
+    pthread_mutex_init(&state.written_lock, NULL);
+
+    if (!init_frame_queue(&state.decoded, config->prefetch_depth)) {
+        pthread_mutex_destroy(&state.written_lock);
+        free(encoders);
+        free(slot_indices);
+        return -1;
+    }
+    if (!init_frame_queue(&state.denoised, config->encode_depth)) {
+        destroy_frame_queue(&state.decoded);
+        pthread_mutex_destroy(&state.written_lock);
+        free(encoders);
+        free(slot_indices);
+        return -1;
+    }
+
+    pthread_t decoder;
+    if (pthread_create(&decoder, NULL, decode_stage, &state) != 0) {
+        destroy_frame_queue(&state.denoised);
+        destroy_frame_queue(&state.decoded);
+        pthread_mutex_destroy(&state.written_lock);
+        free(encoders);
+        free(slot_indices);
+        return -1;
+    }
+    // Run with however many encoders could be started, as long as there is one
+    int started_encoders = 0;
+    while (started_encoders < num_encoders &&
+           pthread_create(&encoders[started_encoders], NULL, encode_stage, &state) == 0) {
+        started_encoders++;
+    }
+    if (started_encoders == 0) {
+        frame_queue_close(&state.decoded);
+        pthread_join(decoder, NULL);
+        destroy_frame_queue(&state.denoised);
+        destroy_frame_queue(&state.decoded);
+        pthread_mutex_destroy(&state.written_lock);
+        free(encoders);
+        free(slot_indices);
+        return -1;
+    }
+
+    // Denoise on the calling thread, which also drives the block matching pool
+    Image* frame;
+    Image* plane;
+    int frame_idx;
+    while (frame_queue_pop(&state.decoded, &frame, &plane, &frame_idx)) {
+        int slot = buffer->current;
+        if (add_frame_to_buffer_with_plane(buffer, frame, plane) != 0) {
+            fprintf(stderr, "Failed to add frame %d to buffer\n", frame_idx);
+            free_image(frame);
+            free_image(plane);
+            continue;
+        }
+        slot_indices[slot] = frame_idx;
+
+        // Denoise the frame whose newer neighbors have all arrived. Until the
+        // buffer fills, its older side is cut short by the start of the input.
+        if (buffer->size > params->temporal_radius) {
+            denoise_and_queue(&state, buffer, params, slot_indices, params->temporal_radius);
+        }
+    }
+
+    // The input has ended: the newest r frames (or all of a shorter input)
+    // are still waiting for neighbors that will never come
+    int pending = buffer->size < params->temporal_radius ? buffer->size : params->temporal_radius;
+    for (int age = pending - 1; age >= 0; age--) {
+        denoise_and_queue(&state, buffer, params, slot_indices, age);
+    }
+
+    frame_queue_close(&state.denoised);
+    pthread_join(decoder, NULL);
+    for (int i = 0; i < started_encoders; i++) {
+        pthread_join(encoders[i], NULL);
+    }
+    // Saves still running when the last frame was closed belong to it
+    prof_flush();
+
+    destroy_frame_queue(&state.denoised);
+    destroy_frame_queue(&state.decoded);
+    pthread_mutex_destroy(&state.written_lock);
+    free(encoders);
+    free(slot_indices);
+    return state.frames_written;
+}
@@ -0,0 +1,39 @@
+/**
+ * @file pipeline.h
+ * @brief Pipelined decode / denoise / encode executor for video denoising
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "video_denoising.h"
+#include "video_io.h"
+
+typedef struct {
+    const char* input_pattern;   // printf pattern for input frames
+    const char* output_pattern;  // printf pattern for denoised frames
+    VideoReader* reader;         // Read frames from this stream instead of input_pattern (not owned)
+    VideoWriter* writer;         // Write frames to this stream instead of output_pattern (not owned)
+    int num_frames;              // With a reader, 0 or less reads to the end of the stream
+    int prefetch_depth;          // Decoded frames allowed to wait for denoising
+    int encode_depth;            // Denoised frames allowed to wait for encoding
+    int encode_threads;          // Image files encoded at once (a stream is written by one thread)
+    int png_level;               // zlib level of output PNGs (0 stores, 1 fastest, 9 smallest)
+    ImageLayout layout;          // Frames are converted to this layout as they are decoded
+    int border;                  // and given this many replicated edge pixels (views over a mapped
+                                 // reader's frames have none)
+    ImagePool* image_pool;       // Decoded frames are recycled through this pool (may be NULL)
+} PipelineConfig;
+
+// Run decode, denoise and encode on separate threads connected by bounded
+// queues, with encode_threads encoders sharing the output queue. Decoding
+// runs up to prefetch_depth frames ahead and blocks when the denoiser falls
+// behind; the denoiser likewise blocks on a full encode queue.
+// Frame N is written as soon as frames N - r .. N + r have been decoded.
+// The first and last r frames are averaged over the neighbors that exist,
+// so every decoded frame is written and a stream keeps its frame count.
+// Returns the number of frames written, or -1 if the pipeline could not start.
+int run_denoising_pipeline(const PipelineConfig* config, FrameBuffer* buffer,
+                           const DenoisingParams* params);
+
+#endif // PIPELINE_H
@@ -0,0 +1,99 @@
+#include <string.h>
+#include "pixel_convert.h"
+#include "tile_distance.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PIXEL_CONVERT_X86 1
+#endif
+
+typedef void (*U8ToFloatFn)(const uint8_t* src, pixel_t* dst, size_t n);
+
+static void u8_to_float_scalar(const uint8_t* src, pixel_t* dst, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = (float)src[i] * (1.0f / 255.0f);
+    }
+}
+
+#ifdef PIXEL_CONVERT_X86
+// 16 samples per step: widen bytes to 32-bit lanes, convert and scale
+__attribute__((target("sse2")))
+static void u8_to_float_sse2(const uint8_t* src, pixel_t* dst, size_t n) {
+    const __m128 scale = _mm_set1_ps(1.0f / 255.0f);
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+        __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), scale));
+        _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), scale));
+        _mm_storeu_ps(dst + i + 8, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), scale));
+        _mm_storeu_ps(dst + i + 12, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), scale));
+    }
+    u8_to_float_scalar(src + i, dst + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void u8_to_float_avx2(const uint8_t* src, pixel_t* dst, size_t n) {
+    const __m256 scale = _mm256_set1_ps(1.0f / 255.0f);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(src + i));
+        __m256i lo = _mm256_cvtepu8_epi32(bytes);
+        __m256i hi = _mm256_cvtepu8_epi32(_mm_srli_si128(bytes, 8));
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(lo), scale));
+        _mm256_storeu_ps(dst + i + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(hi), scale));
+    }
+    u8_to_float_scalar(src + i, dst + i, n - i);
+}
+#endif
+
+void convert_u8_to_float(const uint8_t* src, pixel_t* dst, size_t n) {
+    static U8ToFloatFn kernel = NULL;
+    if (!kernel) {
+        U8ToFloatFn selected = u8_to_float_scalar;
+#ifdef PIXEL_CONVERT_X86
+        SimdLevel level = detect_simd_level();
+        if (level >= SIMD_LEVEL_AVX2) {
+            selected = u8_to_float_avx2;
+        } else if (level >= SIMD_LEVEL_SSE) {
+            selected = u8_to_float_sse2;
+        }
+#endif
+        kernel = selected;
+    }
+    kernel(src, dst, n);
+}
+
+// Constant strides per channel count, so the compiler vectorizes each loop
+void interleaved_to_luma(const pixel_t* src, int channels, pixel_t* dst, size_t n) {
+    if (channels == 3) {
+        for (size_t i = 0; i < n; i++) {
+            dst[i] = LUMA_WEIGHT_R * src[3 * i] + LUMA_WEIGHT_G * src[3 * i + 1] + LUMA_WEIGHT_B * src[3 * i + 2];
+        }
+    } else if (channels == 4) {
+        for (size_t i = 0; i < n; i++) {
+            dst[i] = LUMA_WEIGHT_R * src[4 * i] + LUMA_WEIGHT_G * src[4 * i + 1] + LUMA_WEIGHT_B * src[4 * i + 2];
+        }
+    } else if (channels == 1) {
+        memcpy(dst, src, sizeof(pixel_t) * n);
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            dst[i] = src[(size_t)channels * i];
+        }
+    }
+}
+
+void planar_to_luma(const pixel_t* const* planes, int channels, pixel_t* dst, size_t n) {
+    if (channels < 3) {
+        memcpy(dst, planes[0], sizeof(pixel_t) * n);
+        return;
+    }
+    const pixel_t* r = planes[0];
+    const pixel_t* g = planes[1];
+    const pixel_t* b = planes[2];
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = LUMA_WEIGHT_R * r[i] + LUMA_WEIGHT_G * g[i] + LUMA_WEIGHT_B * b[i];
+    }
+}
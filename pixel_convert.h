@@ -0,0 +1,29 @@
+/**
+ * @file pixel_convert.h
+ * @brief SIMD sample conversion and luma kernels for decoding frames
+ */
+
+#ifndef PIXEL_CONVERT_H
+#define PIXEL_CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "block_matching.h"
+
+// BT.601 luma weights, the ones YUV sources were encoded with
+#define LUMA_WEIGHT_R 0.299f
+#define LUMA_WEIGHT_G 0.587f
+#define LUMA_WEIGHT_B 0.114f
+
+// Scale n 8-bit samples to [0, 1]. Uses the best instruction set of the
+// running CPU (see detect_simd_level).
+void convert_u8_to_float(const uint8_t* src, pixel_t* dst, size_t n);
+
+// Luma of n pixels of `channels` interleaved samples: RGB and RGBA are
+// weighted, gray and gray + alpha keep their first channel
+void interleaved_to_luma(const pixel_t* src, int channels, pixel_t* dst, size_t n);
+
+// Same for one row of each plane of an RGB(A) or gray image
+void planar_to_luma(const pixel_t* const* planes, int channels, pixel_t* dst, size_t n);
+
+#endif // PIXEL_CONVERT_H
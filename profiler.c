@@ -0,0 +1,223 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "profiler.h"
+
+static const char* const STAGE_NAMES[PROF_NUM_STAGES] = {
+    "load", "pyramid", "block_matching", "ica", "warp_merge", "save", "denoise"
+};
+
+static const char* const COUNTER_NAMES[PROF_NUM_COUNTERS] = {
+    "bm_candidates", "bm_rows_evaluated", "bm_rows_skipped",
+    "ica_patches", "pixels_loaded", "pixels_saved"
+};
+
+typedef struct {
+    uint64_t stage_ns[PROF_NUM_STAGES];
+    uint64_t stage_calls[PROF_NUM_STAGES];
+    uint64_t counters[PROF_NUM_COUNTERS];
+} ProfTotals;
+
+// Written only by its owning thread; drained atomically by prof_frame_end
+typedef struct ProfThreadBuffer {
+    ProfTotals totals;
+    struct ProfThreadBuffer* next;
+} ProfThreadBuffer;
+
+typedef struct {
+    int frame_index;
+    ProfTotals totals;
+} ProfFrameRecord;
+
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static ProfThreadBuffer* thread_buffers = NULL;
+static __thread ProfThreadBuffer* local_buffer = NULL;
+// Bumped by prof_shutdown; a thread's buffer from an earlier generation has
+// been freed and is replaced instead of written to
+static unsigned buffer_generation = 1;
+static __thread unsigned local_generation = 0;
+
+static ProfFrameRecord* frame_records = NULL;
+static int num_frame_records = 0;
+static int frame_record_capacity = 0;
+static ProfTotals aggregate;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static ProfThreadBuffer* get_thread_buffer(void) {
+    unsigned generation = __atomic_load_n(&buffer_generation, __ATOMIC_ACQUIRE);
+    if (!local_buffer || local_generation != generation) {
+        ProfThreadBuffer* buffer = (ProfThreadBuffer*)calloc(1, sizeof(ProfThreadBuffer));
+        if (!buffer) return NULL;
+        pthread_mutex_lock(&prof_lock);
+        buffer->next = thread_buffers;
+        thread_buffers = buffer;
+        local_generation = __atomic_load_n(&buffer_generation, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&prof_lock);
+        local_buffer = buffer;
+    }
+    return local_buffer;
+}
+
+ProfScope prof_scope_begin(ProfStage stage) {
+    ProfScope scope = {stage, now_ns()};
+    return scope;
+}
+
+void prof_scope_end(ProfScope* scope) {
+    uint64_t elapsed = now_ns() - scope->start_ns;
+    ProfThreadBuffer* buffer = get_thread_buffer();
+    if (!buffer) return;
+    __atomic_fetch_add(&buffer->totals.stage_ns[scope->stage], elapsed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&buffer->totals.stage_calls[scope->stage], 1, __ATOMIC_RELAXED);
+}
+
+void prof_count(ProfCounter counter, uint64_t amount) {
+    ProfThreadBuffer* buffer = get_thread_buffer();
+    if (!buffer) return;
+    __atomic_fetch_add(&buffer->totals.counters[counter], amount, __ATOMIC_RELAXED);
+}
+
+static void add_totals(ProfTotals* dst, const ProfTotals* src) {
+    for (int s = 0; s < PROF_NUM_STAGES; s++) {
+        dst->stage_ns[s] += src->stage_ns[s];
+        dst->stage_calls[s] += src->stage_calls[s];
+    }
+    for (int c = 0; c < PROF_NUM_COUNTERS; c++) {
+        dst->counters[c] += src->counters[c];
+    }
+}
+
+// Take everything recorded on all threads since the last drain. Caller holds prof_lock.
+static void drain_thread_buffers(ProfTotals* totals) {
+    memset(totals, 0, sizeof(*totals));
+    for (ProfThreadBuffer* buffer = thread_buffers; buffer; buffer = buffer->next) {
+        for (int s = 0; s < PROF_NUM_STAGES; s++) {
+            totals->stage_ns[s] += __atomic_exchange_n(&buffer->totals.stage_ns[s], 0, __ATOMIC_RELAXED);
+            totals->stage_calls[s] += __atomic_exchange_n(&buffer->totals.stage_calls[s], 0, __ATOMIC_RELAXED);
+        }
+        for (int c = 0; c < PROF_NUM_COUNTERS; c++) {
+            totals->counters[c] += __atomic_exchange_n(&buffer->totals.counters[c], 0, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void prof_frame_end(int frame_index) {
+    ProfTotals frame;
+
+    pthread_mutex_lock(&prof_lock);
+    drain_thread_buffers(&frame);
+
+    if (num_frame_records == frame_record_capacity) {
+        int capacity = frame_record_capacity ? frame_record_capacity * 2 : 64;
+        ProfFrameRecord* records = (ProfFrameRecord*)realloc(frame_records, sizeof(ProfFrameRecord) * capacity);
+        if (records) {
+            frame_records = records;
+            frame_record_capacity = capacity;
+        }
+    }
+    if (num_frame_records < frame_record_capacity) {
+        frame_records[num_frame_records].frame_index = frame_index;
+        frame_records[num_frame_records].totals = frame;
+        num_frame_records++;
+    }
+    add_totals(&aggregate, &frame);
+    pthread_mutex_unlock(&prof_lock);
+}
+
+void prof_flush(void) {
+    ProfTotals rest;
+
+    pthread_mutex_lock(&prof_lock);
+    drain_thread_buffers(&rest);
+    if (num_frame_records > 0) {
+        add_totals(&frame_records[num_frame_records - 1].totals, &rest);
+    }
+    add_totals(&aggregate, &rest);
+    pthread_mutex_unlock(&prof_lock);
+}
+
+void prof_report_text(FILE* out) {
+    if (!PROFILER_ENABLED) {
+        fprintf(out, "Profiling compiled out (PROFILER_ENABLED=0)\n");
+        return;
+    }
+
+    pthread_mutex_lock(&prof_lock);
+    fprintf(out, "%8s", "frame");
+    for (int s = 0; s < PROF_NUM_STAGES; s++) {
+        fprintf(out, " %14s", STAGE_NAMES[s]);
+    }
+    fprintf(out, "   (ms)\n");
+
+    for (int i = 0; i < num_frame_records; i++) {
+        fprintf(out, "%8d", frame_records[i].frame_index);
+        for (int s = 0; s < PROF_NUM_STAGES; s++) {
+            fprintf(out, " %14.3f", frame_records[i].totals.stage_ns[s] * 1e-6);
+        }
+        fprintf(out, "\n");
+    }
+
+    int frames = num_frame_records > 0 ? num_frame_records : 1;
+    fprintf(out, "\nAggregate over %d frames:\n", num_frame_records);
+    fprintf(out, "  %-18s %12s %12s %10s\n", "stage", "total ms", "ms/frame", "calls");
+    for (int s = 0; s < PROF_NUM_STAGES; s++) {
+        fprintf(out, "  %-18s %12.3f %12.3f %10llu\n", STAGE_NAMES[s],
+                aggregate.stage_ns[s] * 1e-6, aggregate.stage_ns[s] * 1e-6 / frames,
+                (unsigned long long)aggregate.stage_calls[s]);
+    }
+    for (int c = 0; c < PROF_NUM_COUNTERS; c++) {
+        fprintf(out, "  %-18s %12llu\n", COUNTER_NAMES[c], (unsigned long long)aggregate.counters[c]);
+    }
+    pthread_mutex_unlock(&prof_lock);
+}
+
+static void write_totals_json(FILE* out, const ProfTotals* totals) {
+    fprintf(out, "{\"stages\": {");
+    for (int s = 0; s < PROF_NUM_STAGES; s++) {
+        fprintf(out, "%s\"%s\": {\"ms\": %.6f, \"calls\": %llu}", s ? ", " : "", STAGE_NAMES[s],
+                totals->stage_ns[s] * 1e-6, (unsigned long long)totals->stage_calls[s]);
+    }
+    fprintf(out, "}, \"counters\": {");
+    for (int c = 0; c < PROF_NUM_COUNTERS; c++) {
+        fprintf(out, "%s\"%s\": %llu", c ? ", " : "", COUNTER_NAMES[c],
+                (unsigned long long)totals->counters[c]);
+    }
+    fprintf(out, "}}");
+}
+
+void prof_report_json(FILE* out) {
+    pthread_mutex_lock(&prof_lock);
+    fprintf(out, "{\n  \"enabled\": %s,\n  \"frames\": [\n", PROFILER_ENABLED ? "true" : "false");
+    for (int i = 0; i < num_frame_records; i++) {
+        fprintf(out, "    {\"frame\": %d, \"data\": ", frame_records[i].frame_index);
+        write_totals_json(out, &frame_records[i].totals);
+        fprintf(out, "}%s\n", i + 1 < num_frame_records ? "," : "");
+    }
+    fprintf(out, "  ],\n  \"aggregate\": ");
+    write_totals_json(out, &aggregate);
+    fprintf(out, "\n}\n");
+    pthread_mutex_unlock(&prof_lock);
+}
+
+void prof_shutdown(void) {
+    pthread_mutex_lock(&prof_lock);
+    while (thread_buffers) {
+        ProfThreadBuffer* next = thread_buffers->next;
+        free(thread_buffers);
+        thread_buffers = next;
+    }
+    local_buffer = NULL;
+    __atomic_fetch_add(&buffer_generation, 1, __ATOMIC_RELEASE);
+    free(frame_records);
+    frame_records = NULL;
+    num_frame_records = 0;
+    frame_record_capacity = 0;
+    memset(&aggregate, 0, sizeof(aggregate));
+    pthread_mutex_unlock(&prof_lock);
+}
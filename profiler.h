@@ -0,0 +1,83 @@
+/**
+ * @file profiler.h
+ * @brief Per-stage timers and counters with per-frame and aggregate reports
+ */
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Build with -DPROFILER_ENABLED=0 (make PROFILE=0) to compile the probes out
+#ifndef PROFILER_ENABLED
+#define PROFILER_ENABLED 1
+#endif
+
+// Pipeline stages. Times are inclusive: denoise contains block matching and
+// warp_merge, and pyramid time is also counted where pyramids are built.
+// Warping and averaging run fused (warp_and_average), so warp_merge times
+// both; warp_image and temporal_average count there too when called alone.
+typedef enum {
+    PROF_STAGE_LOAD = 0,
+    PROF_STAGE_PYRAMID,
+    PROF_STAGE_BLOCK_MATCHING,
+    PROF_STAGE_ICA,
+    PROF_STAGE_WARP_MERGE,
+    PROF_STAGE_SAVE,
+    PROF_STAGE_DENOISE,
+    PROF_NUM_STAGES
+} ProfStage;
+
+typedef enum {
+    PROF_COUNTER_BM_CANDIDATES = 0,
+    PROF_COUNTER_BM_ROWS_EVALUATED,
+    PROF_COUNTER_BM_ROWS_SKIPPED,
+    PROF_COUNTER_ICA_PATCHES,
+    PROF_COUNTER_PIXELS_LOADED,
+    PROF_COUNTER_PIXELS_SAVED,
+    PROF_NUM_COUNTERS
+} ProfCounter;
+
+// Active timer; ends when the enclosing scope exits
+typedef struct {
+    ProfStage stage;
+    uint64_t start_ns;
+} ProfScope;
+
+// Probes. Each thread records into its own buffer without locking.
+ProfScope prof_scope_begin(ProfStage stage);
+void prof_scope_end(ProfScope* scope);
+void prof_count(ProfCounter counter, uint64_t amount);
+
+// Close the current frame: move everything recorded since the previous call,
+// on all threads, into a per-frame record and the aggregate totals
+void prof_frame_end(int frame_index);
+
+// Fold anything recorded since the last frame_end into the newest record
+// (and the aggregate) without opening a frame, for work that finishes after
+// the last frame is closed, such as its save
+void prof_flush(void);
+
+// Reports over all closed frames
+void prof_report_text(FILE* out);
+void prof_report_json(FILE* out);
+
+// Release all buffers and records. Threads that record afterwards start new
+// buffers; none may be recording during the call, so join workers first.
+void prof_shutdown(void);
+
+#define PROF_CONCAT_INNER(a, b) a##b
+#define PROF_CONCAT(a, b) PROF_CONCAT_INNER(a, b)
+
+#if PROFILER_ENABLED
+#define PROF_SCOPE(stage) \
+    ProfScope PROF_CONCAT(prof_scope_, __LINE__) __attribute__((cleanup(prof_scope_end))) = \
+        prof_scope_begin(stage)
+#define PROF_COUNT(counter, amount) prof_count((counter), (uint64_t)(amount))
+#else
+#define PROF_SCOPE(stage) ((void)0)
+#define PROF_COUNT(counter, amount) ((void)0)
+#endif
+
+#endif // PROFILER_H
@@ -0,0 +1,144 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "thread_pool.h"
+
+struct ThreadPool {
+    pthread_t* threads;
+    int num_workers;            // Threads besides the caller
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    pthread_mutex_t dispatch_lock;  // One parallel_for at a time
+
+    // Current job, published under lock
+    ThreadPoolTaskFn fn;
+    void* ctx;
+    int num_tasks;
+    int next_task;              // Claimed atomically by workers
+    int active_workers;
+    unsigned long generation;
+    bool shutdown;
+};
+
+static void run_tasks(ThreadPool* pool) {
+    for (;;) {
+        int task = __atomic_fetch_add(&pool->next_task, 1, __ATOMIC_RELAXED);
+        if (task >= pool->num_tasks) break;
+        pool->fn(pool->ctx, task);
+    }
+}
+
+static void* worker_main(void* arg) {
+    ThreadPool* pool = (ThreadPool*)arg;
+    unsigned long seen_generation = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->shutdown && pool->generation == seen_generation) {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+        if (pool->shutdown) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        seen_generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        run_tasks(pool);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->active_workers == 0) {
+            pthread_cond_signal(&pool->work_done);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+ThreadPool* create_thread_pool(int num_threads) {
+    if (num_threads < 1) num_threads = 1;
+
+    ThreadPool* pool = (ThreadPool*)calloc(1, sizeof(ThreadPool));
+    if (!pool) return NULL;
+
+    pool->threads = (pthread_t*)malloc(sizeof(pthread_t) * num_threads);
+    if (!pool->threads) {
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_init(&pool->dispatch_lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+
+    for (int i = 0; i < num_threads - 1; i++) {
+        if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0) {
+            free_thread_pool(pool);
+            return NULL;
+        }
+        pool->num_workers++;
+    }
+
+    return pool;
+}
+
+void free_thread_pool(ThreadPool* pool) {
+    if (!pool) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->num_workers; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->work_done);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_mutex_destroy(&pool->dispatch_lock);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+int thread_pool_num_threads(const ThreadPool* pool) {
+    return pool ? pool->num_workers + 1 : 1;
+}
+
+void thread_pool_parallel_for(ThreadPool* pool, int num_tasks, ThreadPoolTaskFn fn, void* ctx) {
+    if (num_tasks <= 0) return;
+
+    if (!pool || pool->num_workers == 0 || num_tasks == 1) {
+        for (int i = 0; i < num_tasks; i++) {
+            fn(ctx, i);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->dispatch_lock);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->ctx = ctx;
+    pool->num_tasks = num_tasks;
+    pool->next_task = 0;
+    pool->active_workers = pool->num_workers;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    // The caller works too instead of just waiting
+    run_tasks(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->active_workers > 0) {
+        pthread_cond_wait(&pool->work_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_mutex_unlock(&pool->dispatch_lock);
+}
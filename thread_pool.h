@@ -0,0 +1,24 @@
+/**
+ * @file thread_pool.h
+ * @brief Persistent worker pool for data-parallel loops
+ */
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+typedef struct ThreadPool ThreadPool;
+
+// Called once per task index in [0, num_tasks)
+typedef void (*ThreadPoolTaskFn)(void* ctx, int task_idx);
+
+// Create a pool running num_threads tasks at once (the caller counts as one)
+ThreadPool* create_thread_pool(int num_threads);
+void free_thread_pool(ThreadPool* pool);
+int thread_pool_num_threads(const ThreadPool* pool);
+
+// Run fn for every task index and wait for all of them to finish. A NULL pool
+// runs the tasks serially on the calling thread. Calls from different threads
+// are serialized; tasks must not call back into the same pool.
+void thread_pool_parallel_for(ThreadPool* pool, int num_tasks, ThreadPoolTaskFn fn, void* ctx);
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,712 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <math.h>
+#include "tile_distance.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TILE_DISTANCE_X86 1
+#endif
+
+typedef struct {
+    int row_len;
+    TileDistanceFn sad;
+    TileDistanceFn ssd;
+} TileKernelEntry;
+
+// Scalar fallback kernels
+static float sad_scalar(const pixel_t* ref, int ref_stride,
+                        const pixel_t* alt, int alt_stride,
+                        int row_len, int rows, float bound, int* rows_done) {
+    float dist = 0;
+    for (int y = 0; y < rows; y++) {
+        const pixel_t* r = ref + (size_t)y * ref_stride;
+        const pixel_t* a = alt + (size_t)y * alt_stride;
+        float row_dist = 0;
+        for (int i = 0; i < row_len; i++) {
+            row_dist += fabsf(r[i] - a[i]);
+        }
+        dist += row_dist;
+        if (dist > bound) {
+            *rows_done = y + 1;
+            return dist;
+        }
+    }
+    *rows_done = rows;
+    return dist;
+}
+
+static float ssd_scalar(const pixel_t* ref, int ref_stride,
+                        const pixel_t* alt, int alt_stride,
+                        int row_len, int rows, float bound, int* rows_done) {
+    float dist = 0;
+    for (int y = 0; y < rows; y++) {
+        const pixel_t* r = ref + (size_t)y * ref_stride;
+        const pixel_t* a = alt + (size_t)y * alt_stride;
+        float row_dist = 0;
+        for (int i = 0; i < row_len; i++) {
+            float diff = r[i] - a[i];
+            row_dist += diff * diff;
+        }
+        dist += row_dist;
+        if (dist > bound) {
+            *rows_done = y + 1;
+            return dist;
+        }
+    }
+    *rows_done = rows;
+    return dist;
+}
+
+// Scalar integer kernels, instantiated for uint8_t and uint16_t samples
+#define DEFINE_PACKED_SCALAR_KERNELS(TYPE, SUFFIX)                                        \
+    static float sad_##SUFFIX##_scalar(const void* ref, int ref_stride,                   \
+                                       const void* alt, int alt_stride,                   \
+                                       int row_len, int rows, float bound, int* rows_done) { \
+        float dist = 0;                                                                   \
+        for (int y = 0; y < rows; y++) {                                                  \
+            const TYPE* r = (const TYPE*)ref + (size_t)y * ref_stride;                    \
+            const TYPE* a = (const TYPE*)alt + (size_t)y * alt_stride;                    \
+            int row_dist = 0;                                                             \
+            for (int i = 0; i < row_len; i++) {                                           \
+                row_dist += abs((int)r[i] - (int)a[i]);                                   \
+            }                                                                             \
+            dist += (float)row_dist;                                                      \
+            if (dist > bound) {                                                           \
+                *rows_done = y + 1;                                                       \
+                return dist;                                                              \
+            }                                                                             \
+        }                                                                                 \
+        *rows_done = rows;                                                                \
+        return dist;                                                                      \
+    }                                                                                     \
+    static float ssd_##SUFFIX##_scalar(const void* ref, int ref_stride,                   \
+                                       const void* alt, int alt_stride,                   \
+                                       int row_len, int rows, float bound, int* rows_done) { \
+        float dist = 0;                                                                   \
+        for (int y = 0; y < rows; y++) {                                                  \
+            const TYPE* r = (const TYPE*)ref + (size_t)y * ref_stride;                    \
+            const TYPE* a = (const TYPE*)alt + (size_t)y * alt_stride;                    \
+            float row_dist = 0;                                                           \
+            for (int i = 0; i < row_len; i++) {                                           \
+                float diff = (float)((int)r[i] - (int)a[i]);                              \
+                row_dist += diff * diff;                                                  \
+            }                                                                             \
+            dist += row_dist;                                                             \
+            if (dist > bound) {                                                           \
+                *rows_done = y + 1;                                                       \
+                return dist;                                                              \
+            }                                                                             \
+        }                                                                                 \
+        *rows_done = rows;                                                                \
+        return dist;                                                                      \
+    }
+
+DEFINE_PACKED_SCALAR_KERNELS(uint8_t, u8)
+DEFINE_PACKED_SCALAR_KERNELS(uint16_t, u16)
+
+#ifdef TILE_DISTANCE_X86
+
+// SSE kernels (4 samples per step)
+__attribute__((target("sse2")))
+static inline float hsum_sse(__m128 v) {
+    __m128 shuf = _mm_movehl_ps(v, v);
+    __m128 sums = _mm_add_ps(v, shuf);
+    shuf = _mm_shuffle_ps(sums, sums, 1);
+    sums = _mm_add_ss(sums, shuf);
+    return _mm_cvtss_f32(sums);
+}
+
+__attribute__((target("sse2")))
+static float sad_sse(const pixel_t* ref, int ref_stride,
+                     const pixel_t* alt, int alt_stride,
+                     int row_len, int rows, float bound, int* rows_done) {
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    float dist = 0;
+    for (int y = 0; y < rows; y++) {
+        __m128 acc = _mm_setzero_ps();
+        float tail = 0;
+        const pixel_t* r = ref + (size_t)y * ref_stride;
+        const pixel_t* a = alt + (size_t)y * alt_stride;
+        int i = 0;
+        for (; i + 4 <= row_len; i += 4) {
+            __m128 diff = _mm_sub_ps(_mm_loadu_ps(r + i), _mm_loadu_ps(a + i));
+            acc = _mm_add_ps(acc, _mm_andnot_ps(sign, diff));
+        }
+        for (; i < row_len; i++) {
+            tail += fabsf(r[i] - a[i]);
+        }
+        dist += hsum_sse(acc) + tail;
+        if (dist > bound) {
+            *rows_done = y + 1;
+            return dist;
+        }
+    }
+    *rows_done = rows;
+    return dist;
+}
+
+__attribute__((target("sse2")))
+static float ssd_sse(const pixel_t* ref, int ref_stride,
+                     const pixel_t* alt, int alt_stride,
+                     int row_len, int rows, float bound, int* rows_done) {
+    float dist = 0;
+    for (int y = 0; y < rows; y++) {
+        __m128 acc = _mm_setzero_ps();
+        float tail = 0;
+        const pixel_t* r = ref + (size_t)y * ref_stride;
+        const pixel_t* a = alt + (size_t)y * alt_stride;
+        int i = 0;
+        for (; i + 4 <= row_len; i += 4) {
+            __m128 diff = _mm_sub_ps(_mm_loadu_ps(r + i), _mm_loadu_ps(a + i));
+            acc = _mm_add_ps(acc, _mm_mul_ps(diff, diff));
+        }
+        for (; i < row_len; i++) {
+            float diff = r[i] - a[i];
+            tail += diff * diff;
+        }
+        dist += hsum_sse(acc) + tail;
+        if (dist > bound) {
+            *rows_done = y + 1;
+            return dist;
+        }
+    }
+    *rows_done = rows;
+    return dist;
+}
+
+// AVX2 kernels (8 samples per step). The inline bodies are instantiated with a
+// constant row length for the common tile widths so the row loop unrolls.
+__attribute__((target("avx2")))
+static inline float hsum_avx2(__m256 v) {
+    __m128 sums = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    __m128 shuf = _mm_movehl_ps(sums, sums);
+    sums = _mm_add_ps(sums, shuf);
+    shuf = _mm_shuffle_ps(sums, sums, 1);
+    sums = _mm_add_ss(sums, shuf);
+    return _mm_cvtss_f32(sums);
+}
+
+__attribute__((always_inline, target("avx2")))
+static inline float sad_avx2_body(const pixel_t* ref, int ref_stride,
+                                  const pixel_t* alt, int alt_stride,
+                                  int row_len, int rows, float bound, int* rows_done) {
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    float dist = 0;
+    for (int y = 0; y < rows; y++) {
+        __m256 acc = _mm256_setzero_ps();
+        float tail = 0;
+        const pixel_t* r = ref + (size_t)y * ref_stride;
+        const pixel_t* a = alt + (size_t)y * alt_stride;
+        int i = 0;
+        for (; i + 8 <= row_len; i += 8) {
+            __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(r + i), _mm256_loadu_ps(a + i));
+            acc = _mm256_add_ps(acc, _mm256_andnot_ps(sign, diff));
+        }
+        for (; i < row_len; i++) {
+            tail += fabsf(r[i] - a[i]);
+        }
+        dist += hsum_avx2(acc) + tail;
+        if (dist > bound) {
+            *rows_done = y + 1;
+            return dist;
+        }
+    }
+    *rows_done = rows;
+    return dist;
+}
+
+__attribute__((always_inline, target("avx2")))
+static inline float ssd_avx2_body(const pixel_t* ref, int ref_stride,
+                                  const pixel_t* alt, int alt_stride,
+                                  int row_len, int rows, float bound, int* rows_done) {
+    float dist = 0;
+    for (int y = 0; y < rows; y++) {
+        __m256 acc = _mm256_setzero_ps();
+        float tail = 0;
+        const pixel_t* r = ref + (size_t)y * ref_stride;
+        const pixel_t* a = alt + (size_t)y * alt_stride;
+        int i = 0;
+        for (; i + 8 <= row_len; i += 8) {
+            __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(r + i), _mm256_loadu_ps(a + i));
+            acc = _mm256_add_ps(acc, _mm256_mul_ps(diff, diff));
+        }
+        for (; i < row_len; i++) {
+            float diff = r[i] - a[i];
+            tail += diff * diff;
+        }
+        dist += hsum_avx2(acc) + tail;
+        if (dist > bound) {
+            *rows_done = y + 1;
+            return dist;
+        }
+    }
+    *rows_done = rows;
+    return dist;
+}
+
+#define DEFINE_AVX2_KERNELS(SUFFIX, ROW_LEN)                                              \
+    __attribute__((target("avx2")))                                                       \
+    static float sad_avx2_##SUFFIX(const pixel_t* ref, int ref_stride,                    \
+                                   const pixel_t* alt, int alt_stride,                    \
+                                   int row_len, int rows, float bound, int* rows_done) {  \
+        (void)row_len;                                                                    \
+        return sad_avx2_body(ref, ref_stride, alt, alt_stride, ROW_LEN, rows,             \
+                             bound, rows_done);                                           \
+    }                                                                                     \
+    __attribute__((target("avx2")))                                                       \
+    static float ssd_avx2_##SUFFIX(const pixel_t* ref, int ref_stride,                    \
+                                   const pixel_t* alt, int alt_stride,                    \
+                                   int row_len, int rows, float bound, int* rows_done) {  \
+        (void)row_len;                                                                    \
+        return ssd_avx2_body(ref, ref_stride, alt, alt_stride, ROW_LEN, rows,             \
+                             bound, rows_done);                                           \
+    }
+
+DEFINE_AVX2_KERNELS(8, 8)
+DEFINE_AVX2_KERNELS(16, 16)
+DEFINE_AVX2_KERNELS(24, 24)
+DEFINE_AVX2_KERNELS(32, 32)
+DEFINE_AVX2_KERNELS(48, 48)
+DEFINE_AVX2_KERNELS(64, 64)
+DEFINE_AVX2_KERNELS(96, 96)
+DEFINE_AVX2_KERNELS(any, row_len)
+
+static const TileKernelEntry avx2_kernels[] = {
+    {8, sad_avx2_8, ssd_avx2_8},
+    {16, sad_avx2_16, ssd_avx2_16},
+    {24, sad_avx2_24, ssd_avx2_24},
+    {32, sad_avx2_32, ssd_avx2_32},
+    {48, sad_avx2_48, ssd_avx2_48},
+    {64, sad_avx2_64, ssd_avx2_64},
+    {96, sad_avx2_96, ssd_avx2_96},
+};
+
+// AVX-512 kernels (16 samples per step, masked tail)
+__attribute__((always_inline, target("avx512f")))
+static inline float sad_avx512_body(const pixel_t* ref, int ref_stride,
+                                    const pixel_t* alt, int alt_stride,
+                                    int row_len, int rows, float bound, int* rows_done) {
+    float dist = 0;
+    for (int y = 0; y < rows; y++) {
+        __m512 acc = _mm512_setzero_ps();
+        const pixel_t* r = ref + (size_t)y * ref_stride;
+        const pixel_t* a = alt + (size_t)y * alt_stride;
+        int i = 0;
+        for (; i + 16 <= row_len; i += 16) {
+            __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(r + i), _mm512_loadu_ps(a + i));
+            acc = _mm512_add_ps(acc, _mm512_abs_ps(diff));
+        }
+        if (i < row_len) {
+            __mmask16 mask = (__mmask16)((1u << (row_len - i)) - 1);
+            __m512 diff = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, r + i),
+                                        _mm512_maskz_loadu_ps(mask, a + i));
+            acc = _mm512_add_ps(acc, _mm512_abs_ps(diff));
+        }
+        dist += _mm512_reduce_add_ps(acc);
+        if (dist > bound) {
+            *rows_done = y + 1;
+            return dist;
+        }
+    }
+    *rows_done = rows;
+    return dist;
+}
+
+__attribute__((always_inline, target("avx512f")))
+static inline float ssd_avx512_body(const pixel_t* ref, int ref_stride,
+                                    const pixel_t* alt, int alt_stride,
+                                    int row_len, int rows, float bound, int* rows_done) {
+    float dist = 0;
+    for (int y = 0; y < rows; y++) {
+        __m512 acc = _mm512_setzero_ps();
+        const pixel_t* r = ref + (size_t)y * ref_stride;
+        const pixel_t* a = alt + (size_t)y * alt_stride;
+        int i = 0;
+        for (; i + 16 <= row_len; i += 16) {
+            __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(r + i), _mm512_loadu_ps(a + i));
+            acc = _mm512_add_ps(acc, _mm512_mul_ps(diff, diff));
+        }
+        if (i < row_len) {
+            __mmask16 mask = (__mmask16)((1u << (row_len - i)) - 1);
+            __m512 diff = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, r + i),
+                                        _mm512_maskz_loadu_ps(mask, a + i));
+            acc = _mm512_add_ps(acc, _mm512_mul_ps(diff, diff));
+        }
+        dist += _mm512_reduce_add_ps(acc);
+        if (dist > bound) {
+            *rows_done = y + 1;
+            return dist;
+        }
+    }
+    *rows_done = rows;
+    return dist;
+}
+
+#define DEFINE_AVX512_KERNELS(SUFFIX, ROW_LEN)                                              \
+    __attribute__((target("avx512f")))                                                      \
+    static float sad_avx512_##SUFFIX(const pixel_t* ref, int ref_stride,                    \
+                                     const pixel_t* alt, int alt_stride,                    \
+                                     int row_len, int rows, float bound, int* rows_done) {  \
+        (void)row_len;                                                                      \
+        return sad_avx512_body(ref, ref_stride, alt, alt_stride, ROW_LEN, rows,             \
+                               bound, rows_done);                                           \
+    }                                                                                       \
+    __attribute__((target("avx512f")))                                                      \
+    static float ssd_avx512_##SUFFIX(const pixel_t* ref, int ref_stride,                    \
+                                     const pixel_t* alt, int alt_stride,                    \
+                                     int row_len, int rows, float bound, int* rows_done) {  \
+        (void)row_len;                                                                      \
+        return ssd_avx512_body(ref, ref_stride, alt, alt_stride, ROW_LEN, rows,             \
+                               bound, rows_done);                                           \
+    }
+
+DEFINE_AVX512_KERNELS(16, 16)
+DEFINE_AVX512_KERNELS(32, 32)
+DEFINE_AVX512_KERNELS(48, 48)
+DEFINE_AVX512_KERNELS(64, 64)
+DEFINE_AVX512_KERNELS(96, 96)
+DEFINE_AVX512_KERNELS(any, row_len)
+
+static const TileKernelEntry avx512_kernels[] = {
+    {16, sad_avx512_16, ssd_avx512_16},
+    {32, sad_avx512_32, ssd_avx512_32},
+    {48, sad_avx512_48, ssd_avx512_48},
+    {64, sad_avx512_64, ssd_avx512_64},
+    {96, sad_avx512_96, ssd_avx512_96},
+};
+
+// Integer kernels keep per-row sums in vector registers and reduce them only
+// when checking the bound, every second row, to keep the reduction off the
+// per-row dependency chain.
+
+// 8-bit SAD with psadbw, 16 samples per step
+__attribute__((target("sse2")))
+static inline int hsum_epi64_sse(__m128i v) {
+    return (int)_mm_cvtsi128_si64(_mm_add_epi64(v, _mm_unpackhi_epi64(v, v)));
+}
+
+__attribute__((target("sse2")))
+static float sad_u8_sse(const void* ref, int ref_stride,
+                        const void* alt, int alt_stride,
+                        int row_len, int rows, float bound, int* rows_done) {
+    __m128i acc = _mm_setzero_si128();
+    int tail = 0;
+    for (int y = 0; y < rows; y++) {
+        const uint8_t* r = (const uint8_t*)ref + (size_t)y * ref_stride;
+        const uint8_t* a = (const uint8_t*)alt + (size_t)y * alt_stride;
+        int i = 0;
+        for (; i + 16 <= row_len; i += 16) {
+            acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(r + i)),
+                                                  _mm_loadu_si128((const __m128i*)(a + i))));
+        }
+        for (; i < row_len; i++) {
+            tail += abs((int)r[i] - (int)a[i]);
+        }
+        if ((y & 1) || y + 1 == rows) {
+            float dist = (float)(hsum_epi64_sse(acc) + tail);
+            if (dist > bound || y + 1 == rows) {
+                *rows_done = y + 1;
+                return dist;
+            }
+        }
+    }
+    *rows_done = rows;
+    return 0;
+}
+
+__attribute__((target("avx2")))
+static inline int hsum_epi64_avx2(__m256i v) {
+    return hsum_epi64_sse(_mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+}
+
+__attribute__((target("avx2")))
+static inline int hsum_epi32_avx2(__m256i v) {
+    __m128i sums = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    sums = _mm_add_epi32(sums, _mm_unpackhi_epi64(sums, sums));
+    sums = _mm_add_epi32(sums, _mm_shuffle_epi32(sums, 1));
+    return _mm_cvtsi128_si32(sums);
+}
+
+// 8-bit SAD, 32 samples per step; rows of 16 or fewer samples go two per register
+__attribute__((always_inline, target("avx2")))
+static inline float sad_u8_avx2_body(const uint8_t* ref, int ref_stride,
+                                     const uint8_t* alt, int alt_stride,
+                                     int row_len, int rows, float bound, int* rows_done) {
+    __m256i acc = _mm256_setzero_si256();
+    int tail = 0;
+    for (int y = 0; y < rows; y++) {
+        const uint8_t* r = ref + (size_t)y * ref_stride;
+        const uint8_t* a = alt + (size_t)y * alt_stride;
+        if (row_len == 16 && y + 1 < rows) {
+            acc = _mm256_add_epi64(acc, _mm256_sad_epu8(
+                _mm256_loadu2_m128i((const __m128i*)(r + ref_stride), (const __m128i*)r),
+                _mm256_loadu2_m128i((const __m128i*)(a + alt_stride), (const __m128i*)a)));
+            y++;
+        } else if (row_len == 8 && y + 1 < rows) {
+            __m128i rv = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)r),
+                                            _mm_loadl_epi64((const __m128i*)(r + ref_stride)));
+            __m128i av = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)a),
+                                            _mm_loadl_epi64((const __m128i*)(a + alt_stride)));
+            acc = _mm256_add_epi64(acc, _mm256_inserti128_si256(_mm256_setzero_si256(),
+                                                                _mm_sad_epu8(rv, av), 0));
+            y++;
+        } else {
+            int i = 0;
+            for (; i + 32 <= row_len; i += 32) {
+                acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)(r + i)),
+                                                            _mm256_loadu_si256((const __m256i*)(a + i))));
+            }
+            for (; i + 16 <= row_len; i += 16) {
+                __m128i sad = _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(r + i)),
+                                           _mm_loadu_si128((const __m128i*)(a + i)));
+                acc = _mm256_add_epi64(acc, _mm256_inserti128_si256(_mm256_setzero_si256(), sad, 0));
+            }
+            for (; i < row_len; i++) {
+                tail += abs((int)r[i] - (int)a[i]);
+            }
+        }
+        if ((y & 1) || y + 1 == rows) {
+            float dist = (float)(hsum_epi64_avx2(acc) + tail);
+            if (dist > bound || y + 1 == rows) {
+                *rows_done = y + 1;
+                return dist;
+            }
+        }
+    }
+    *rows_done = rows;
+    return 0;
+}
+
+// 8-bit SSD: widen 16 samples to 16 bits, square and pair-add with pmaddwd
+__attribute__((always_inline, target("avx2")))
+static inline float ssd_u8_avx2_body(const uint8_t* ref, int ref_stride,
+                                     const uint8_t* alt, int alt_stride,
+                                     int row_len, int rows, float bound, int* rows_done) {
+    __m256i acc = _mm256_setzero_si256();
+    int tail = 0;
+    for (int y = 0; y < rows; y++) {
+        const uint8_t* r = ref + (size_t)y * ref_stride;
+        const uint8_t* a = alt + (size_t)y * alt_stride;
+        int i = 0;
+        for (; i + 16 <= row_len; i += 16) {
+            __m256i diff = _mm256_sub_epi16(
+                _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(r + i))),
+                _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(a + i))));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(diff, diff));
+        }
+        for (; i < row_len; i++) {
+            int diff = (int)r[i] - (int)a[i];
+            tail += diff * diff;
+        }
+        if ((y & 1) || y + 1 == rows) {
+            float dist = (float)(hsum_epi32_avx2(acc) + tail);
+            if (dist > bound || y + 1 == rows) {
+                *rows_done = y + 1;
+                return dist;
+            }
+        }
+    }
+    *rows_done = rows;
+    return 0;
+}
+
+#define DEFINE_U8_AVX2_KERNELS(SUFFIX, ROW_LEN)                                           \
+    __attribute__((target("avx2")))                                                       \
+    static float sad_u8_avx2_##SUFFIX(const void* ref, int ref_stride,                    \
+                                      const void* alt, int alt_stride,                    \
+                                      int row_len, int rows, float bound, int* rows_done) { \
+        (void)row_len;                                                                    \
+        return sad_u8_avx2_body((const uint8_t*)ref, ref_stride, (const uint8_t*)alt,     \
+                                alt_stride, ROW_LEN, rows, bound, rows_done);             \
+    }                                                                                     \
+    __attribute__((target("avx2")))                                                       \
+    static float ssd_u8_avx2_##SUFFIX(const void* ref, int ref_stride,                    \
+                                      const void* alt, int alt_stride,                    \
+                                      int row_len, int rows, float bound, int* rows_done) { \
+        (void)row_len;                                                                    \
+        return ssd_u8_avx2_body((const uint8_t*)ref, ref_stride, (const uint8_t*)alt,     \
+                                alt_stride, ROW_LEN, rows, bound, rows_done);             \
+    }
+
+DEFINE_U8_AVX2_KERNELS(8, 8)
+DEFINE_U8_AVX2_KERNELS(16, 16)
+DEFINE_U8_AVX2_KERNELS(24, 24)
+DEFINE_U8_AVX2_KERNELS(32, 32)
+DEFINE_U8_AVX2_KERNELS(48, 48)
+DEFINE_U8_AVX2_KERNELS(any, row_len)
+
+typedef struct {
+    int row_len;
+    PackedTileDistanceFn sad;
+    PackedTileDistanceFn ssd;
+} PackedKernelEntry;
+
+static const PackedKernelEntry u8_avx2_kernels[] = {
+    {8, sad_u8_avx2_8, ssd_u8_avx2_8},
+    {16, sad_u8_avx2_16, ssd_u8_avx2_16},
+    {24, sad_u8_avx2_24, ssd_u8_avx2_24},
+    {32, sad_u8_avx2_32, ssd_u8_avx2_32},
+    {48, sad_u8_avx2_48, ssd_u8_avx2_48},
+};
+
+// 16-bit kernels: |r - a| as max - min, widened to 32 bits (SAD) or float (SSD)
+__attribute__((target("avx2")))
+static float sad_u16_avx2(const void* ref, int ref_stride,
+                          const void* alt, int alt_stride,
+                          int row_len, int rows, float bound, int* rows_done) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = _mm256_setzero_si256();
+    int tail = 0;
+    for (int y = 0; y < rows; y++) {
+        const uint16_t* r = (const uint16_t*)ref + (size_t)y * ref_stride;
+        const uint16_t* a = (const uint16_t*)alt + (size_t)y * alt_stride;
+        int i = 0;
+        for (; i + 16 <= row_len; i += 16) {
+            __m256i rv = _mm256_loadu_si256((const __m256i*)(r + i));
+            __m256i av = _mm256_loadu_si256((const __m256i*)(a + i));
+            __m256i diff = _mm256_sub_epi16(_mm256_max_epu16(rv, av), _mm256_min_epu16(rv, av));
+            acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(diff, zero));
+            acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(diff, zero));
+        }
+        for (; i < row_len; i++) {
+            tail += abs((int)r[i] - (int)a[i]);
+        }
+        if ((y & 1) || y + 1 == rows) {
+            float dist = (float)(hsum_epi32_avx2(acc) + tail);
+            if (dist > bound || y + 1 == rows) {
+                *rows_done = y + 1;
+                return dist;
+            }
+        }
+    }
+    *rows_done = rows;
+    return 0;
+}
+
+__attribute__((target("avx2")))
+static float ssd_u16_avx2(const void* ref, int ref_stride,
+                          const void* alt, int alt_stride,
+                          int row_len, int rows, float bound, int* rows_done) {
+    __m256 acc = _mm256_setzero_ps();
+    float tail = 0;
+    for (int y = 0; y < rows; y++) {
+        const uint16_t* r = (const uint16_t*)ref + (size_t)y * ref_stride;
+        const uint16_t* a = (const uint16_t*)alt + (size_t)y * alt_stride;
+        int i = 0;
+        for (; i + 8 <= row_len; i += 8) {
+            __m256i diff = _mm256_sub_epi32(
+                _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(r + i))),
+                _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(a + i))));
+            __m256 d = _mm256_cvtepi32_ps(diff);
+            acc = _mm256_add_ps(acc, _mm256_mul_ps(d, d));
+        }
+        for (; i < row_len; i++) {
+            float diff = (float)((int)r[i] - (int)a[i]);
+            tail += diff * diff;
+        }
+        if ((y & 1) || y + 1 == rows) {
+            float dist = hsum_avx2(acc) + tail;
+            if (dist > bound || y + 1 == rows) {
+                *rows_done = y + 1;
+                return dist;
+            }
+        }
+    }
+    *rows_done = rows;
+    return 0;
+}
+
+#endif // TILE_DISTANCE_X86
+
+SimdLevel detect_simd_level(void) {
+    static int cached_level = -1;
+    if (cached_level >= 0) return (SimdLevel)cached_level;
+
+    SimdLevel level = SIMD_LEVEL_SCALAR;
+#ifdef TILE_DISTANCE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        level = SIMD_LEVEL_AVX512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        level = SIMD_LEVEL_AVX2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        level = SIMD_LEVEL_SSE;
+    }
+#endif
+    cached_level = (int)level;
+    return level;
+}
+
+const char* simd_level_name(SimdLevel level) {
+    switch (level) {
+        case SIMD_LEVEL_AVX512: return "avx512";
+        case SIMD_LEVEL_AVX2: return "avx2";
+        case SIMD_LEVEL_SSE: return "sse";
+        default: return "scalar";
+    }
+}
+
+#ifdef TILE_DISTANCE_X86
+static TileDistanceFn find_kernel(const TileKernelEntry* table, int count,
+                                  int distance_metric, int row_len) {
+    for (int i = 0; i < count; i++) {
+        if (table[i].row_len == row_len) {
+            return distance_metric == 0 ? table[i].sad : table[i].ssd;
+        }
+    }
+    return NULL;
+}
+#endif
+
+TileDistanceFn select_tile_distance(int distance_metric, int row_len, SimdLevel level) {
+#ifdef TILE_DISTANCE_X86
+    TileDistanceFn fn = NULL;
+
+    // Rows shorter than a full zmm register run faster on the AVX2 kernels
+    if (level >= SIMD_LEVEL_AVX512 && row_len >= 16) {
+        fn = find_kernel(avx512_kernels, sizeof(avx512_kernels) / sizeof(avx512_kernels[0]),
+                         distance_metric, row_len);
+        if (!fn) fn = distance_metric == 0 ? sad_avx512_any : ssd_avx512_any;
+        return fn;
+    }
+    if (level >= SIMD_LEVEL_AVX2) {
+        fn = find_kernel(avx2_kernels, sizeof(avx2_kernels) / sizeof(avx2_kernels[0]),
+                         distance_metric, row_len);
+        if (!fn) fn = distance_metric == 0 ? sad_avx2_any : ssd_avx2_any;
+        return fn;
+    }
+    if (level >= SIMD_LEVEL_SSE) {
+        return distance_metric == 0 ? sad_sse : ssd_sse;
+    }
+#else
+    (void)row_len;
+    (void)level;
+#endif
+    return distance_metric == 0 ? sad_scalar : ssd_scalar;
+}
+
+PackedTileDistanceFn select_packed_tile_distance(PixelFormat format, int distance_metric, int row_len,
+                                                  SimdLevel level) {
+    bool u8 = format == PIXEL_FORMAT_U8;
+#ifdef TILE_DISTANCE_X86
+    // The integer kernels need AVX2 at most, so AVX-512 machines use those too
+    if (level >= SIMD_LEVEL_AVX2) {
+        if (!u8) return distance_metric == 0 ? sad_u16_avx2 : ssd_u16_avx2;
+        for (size_t i = 0; i < sizeof(u8_avx2_kernels) / sizeof(u8_avx2_kernels[0]); i++) {
+            if (u8_avx2_kernels[i].row_len == row_len) {
+                return distance_metric == 0 ? u8_avx2_kernels[i].sad : u8_avx2_kernels[i].ssd;
+            }
+        }
+        return distance_metric == 0 ? sad_u8_avx2_any : ssd_u8_avx2_any;
+    }
+    if (level >= SIMD_LEVEL_SSE && u8 && distance_metric == 0) {
+        return sad_u8_sse;
+    }
+#else
+    (void)row_len;
+    (void)level;
+#endif
+    if (u8) return distance_metric == 0 ? sad_u8_scalar : ssd_u8_scalar;
+    return distance_metric == 0 ? sad_u16_scalar : ssd_u16_scalar;
+}
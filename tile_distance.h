@@ -0,0 +1,50 @@
+/**
+ * @file tile_distance.h
+ * @brief SIMD tile distance kernels (SAD/SSD) for block matching
+ */
+
+#ifndef TILE_DISTANCE_H
+#define TILE_DISTANCE_H
+
+#include "block_matching.h"
+
+// Instruction set levels, ordered from least to most capable
+typedef enum {
+    SIMD_LEVEL_SCALAR = 0,
+    SIMD_LEVEL_SSE,
+    SIMD_LEVEL_AVX2,
+    SIMD_LEVEL_AVX512
+} SimdLevel;
+
+// Distance between two tiles of `rows` rows, each `row_len` contiguous samples
+// (tile_size * channels for interleaved images). Strides are in samples.
+// Rows are accumulated in order and the kernel returns early, with a partial
+// distance, as soon as the running sum exceeds `bound` (pass FLT_MAX for the
+// full distance). `rows_done` receives the number of rows accumulated.
+typedef float (*TileDistanceFn)(const pixel_t* ref, int ref_stride,
+                                const pixel_t* alt, int alt_stride,
+                                int row_len, int rows,
+                                float bound, int* rows_done);
+
+// Same contract for integer samples (uint8_t or uint16_t per PixelFormat),
+// except that the SIMD kernels test the bound every second row. Distances are
+// in integer sample units.
+typedef float (*PackedTileDistanceFn)(const void* ref, int ref_stride,
+                                      const void* alt, int alt_stride,
+                                      int row_len, int rows,
+                                      float bound, int* rows_done);
+
+// Best instruction set supported by the running CPU (detected once)
+SimdLevel detect_simd_level(void);
+const char* simd_level_name(SimdLevel level);
+
+// Pick a kernel for the metric (0 for L1/SAD, otherwise L2/SSD) and row length.
+// Row lengths of 8, 16, 24, 32, 48, 64 and 96 samples get unrolled kernels.
+TileDistanceFn select_tile_distance(int distance_metric, int row_len, SimdLevel level);
+
+// Kernel for 8- or 16-bit samples; SAD on 8-bit rows uses psadbw. 8-bit row
+// lengths of 8, 16, 24, 32 and 48 samples get unrolled kernels.
+PackedTileDistanceFn select_packed_tile_distance(PixelFormat format, int distance_metric, int row_len,
+                                                  SimdLevel level);
+
+#endif // TILE_DISTANCE_H
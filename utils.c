@@ -3,11 +3,35 @@
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <stdint.h>
+#include <zlib.h>
+#include "utils.h"
+#include "profiler.h"
+#include "pixel_convert.h"
+#include "frame_pool.h"
+
+// PNG deflate goes through zlib, at the level of the save_image_png call on
+// this thread (stb's own level setting is a single global)
+static _Thread_local int png_level = PNG_DEFAULT_LEVEL;
+
+static unsigned char* png_zlib_compress(unsigned char* data, int data_len, int* out_len, int quality) {
+    (void)quality;
+    uLongf len = compressBound((uLong)data_len);
+    unsigned char* out = (unsigned char*)malloc(len);  // Freed by stb
+    if (!out) return NULL;
+    if (compress2(out, &len, data, (uLong)data_len, png_level) != Z_OK) {
+        free(out);
+        return NULL;
+    }
+    *out_len = (int)len;
+    return out;
+}
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
+#define STBIW_ZLIB_COMPRESS png_zlib_compress
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
-#include "utils.h"
 
 // Default parameters based on Python implementation
 static const int DEFAULT_FACTORS[MAX_PYRAMID_LEVELS] = {1, 2, 4, 4};
@@ -15,6 +39,13 @@ static const int DEFAULT_SEARCH_RADII[MAX_PYRAMID_LEVELS] = {1, 4, 4, 4};
 static const bool DEFAULT_USE_L1[MAX_PYRAMID_LEVELS] = {true, false, false, false};
 
 Image* load_image(const char* filename) {
+    return load_image_pooled(filename, NULL, IMAGE_LAYOUT_INTERLEAVED, 0, NULL);
+}
+
+Image* load_image_pooled(const char* filename, ImagePool* pool, ImageLayout layout, int border,
+                         Image** luma) {
+    PROF_SCOPE(PROF_STAGE_LOAD);
+    if (luma) *luma = NULL;
     int width, height, channels;
     unsigned char* data = stbi_load(filename, &width, &height, &channels, 0);
     if (!data) {
@@ -22,50 +53,109 @@ Image* load_image(const char* filename) {
         return NULL;
     }
 
-    // Create image structure with proper number of channels
-    Image* img = create_image(height, width, channels);
-    if (!img) {
+    // Decode straight into pooled images of the caller's geometry
+    Image* img = image_pool_acquire(pool, height, width, channels, layout, border);
+    Image* gray = luma ? image_pool_acquire(pool, height, width, 1, layout, border) : NULL;
+    if (!img || (luma && !gray)) {
+        free_image(img);
+        free_image(gray);
         stbi_image_free(data);
         return NULL;
     }
 
-    // Convert to floating point and normalize to [0,1]
-    for (int i = 0; i < height * width; i++) {
-        for (int c = 0; c < channels; c++) {
-            img->data[i * channels + c] = (float)data[i * channels + c] / 255.0f;
+    // Normalize to [0,1] a row at a time, taking the luma of each row while
+    // it is still in cache
+    size_t row_len = (size_t)width * channels;
+    for (int y = 0; y < height; y++) {
+        const unsigned char* in = data + y * row_len;
+        pixel_t* out = gray ? gray->data + (size_t)y * gray->pitch : NULL;
+        if (layout == IMAGE_LAYOUT_INTERLEAVED || channels == 1) {
+            pixel_t* row = img->data + (size_t)y * img->pitch;
+            convert_u8_to_float(in, row, row_len);
+            if (out) interleaved_to_luma(row, channels, out, width);
+        } else {
+            const pixel_t* planes[4];
+            for (int c = 0; c < channels; c++) {
+                pixel_t* row = image_plane(img, c) + (size_t)y * img->pitch;
+                for (int x = 0; x < width; x++) {
+                    row[x] = (float)in[x * channels + c] * (1.0f / 255.0f);
+                }
+                if (c < 4) planes[c] = row;
+            }
+            if (out) planar_to_luma(planes, channels < 4 ? channels : 4, out, width);
         }
     }
 
     stbi_image_free(data);
+    extend_image_border(img);
+    extend_image_border(gray);
+    PROF_COUNT(PROF_COUNTER_PIXELS_LOADED, width * height);
+    if (luma) *luma = gray;
     return img;
 }
 
 bool save_image(const char* filename, const Image* img) {
+    return save_image_png(filename, img, PNG_DEFAULT_LEVEL);
+}
+
+bool save_image_png(const char* filename, const Image* img, int level) {
     if (!img || !img->data) return false;
+    if (level < 0 || level > 9) return false;
+    PROF_SCOPE(PROF_STAGE_SAVE);
 
-    // Convert to 8-bit, accounting for all channels
-    unsigned char* data = (unsigned char*)malloc(img->height * img->width * img->channels);
+    // Convert to 8-bit, accounting for all channels. PNG rows are interleaved
+    // and unpadded, so planar and bordered images are gathered row by row.
+    int row_len = img->width * img->channels;
+    uint8_t* data = (uint8_t*)malloc((size_t)img->height * row_len);
     if (!data) return false;
 
-    for (int i = 0; i < img->height * img->width * img->channels; i++) {
-        float val = img->data[i];
-        val = val < 0.0f ? 0.0f : (val > 1.0f ? 1.0f : val);
-        data[i] = (unsigned char)(val * 255.0f);
+    // Branch-free clamp and scale, which the compiler vectorizes
+    for (int y = 0; y < img->height; y++) {
+        uint8_t* out = data + (size_t)y * row_len;
+        if (img->layout == IMAGE_LAYOUT_INTERLEAVED || img->channels == 1) {
+            const pixel_t* in = img->data + (size_t)y * img->pitch;
+            for (int i = 0; i < row_len; i++) {
+                out[i] = (uint8_t)(fminf(fmaxf(in[i], 0.0f), 1.0f) * 255.0f);
+            }
+        } else {
+            for (int c = 0; c < img->channels; c++) {
+                const pixel_t* in = image_plane(img, c) + (size_t)y * img->pitch;
+                for (int x = 0; x < img->width; x++) {
+                    out[x * img->channels + c] = (uint8_t)(fminf(fmaxf(in[x], 0.0f), 1.0f) * 255.0f);
+                }
+            }
+        }
     }
 
-    bool success = stbi_write_png(filename, img->width, img->height, img->channels, data, img->width * img->channels);
+    png_level = level;
+    bool success = stbi_write_png(filename, img->width, img->height, img->channels, data, row_len);
     free(data);
+    PROF_COUNT(PROF_COUNTER_PIXELS_SAVED, img->width * img->height);
     return success;
 }
 
 Image* create_grayscale(const Image* color_img) {
     if (!color_img || !color_img->data) return NULL;
 
-    Image* gray = create_image(color_img->height, color_img->width, color_img->channels);
+    Image* gray = image_pool_acquire(color_img->pool, color_img->height, color_img->width, 1,
+                                     color_img->layout, color_img->border);
     if (!gray) return NULL;
 
-    // Copy data (assuming input is already grayscale)
-    memcpy(gray->data, color_img->data, sizeof(pixel_t) * color_img->height * color_img->width);
+    for (int y = 0; y < color_img->height; y++) {
+        pixel_t* out = gray->data + (size_t)y * gray->pitch;
+        if (color_img->layout == IMAGE_LAYOUT_INTERLEAVED) {
+            interleaved_to_luma(color_img->data + (size_t)y * color_img->pitch, color_img->channels, out,
+                                color_img->width);
+        } else {
+            const pixel_t* planes[4];
+            int channels = color_img->channels < 4 ? color_img->channels : 4;
+            for (int c = 0; c < channels; c++) {
+                planes[c] = image_plane(color_img, c) + (size_t)y * color_img->pitch;
+            }
+            planar_to_luma(planes, channels, out, color_img->width);
+        }
+    }
+    extend_image_border(gray);
     return gray;
 }
 
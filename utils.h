@@ -7,6 +7,7 @@
 // Constants
 #define DEFAULT_TILE_SIZE 16
 #define MAX_PYRAMID_LEVELS 4
+#define PNG_DEFAULT_LEVEL 6    // zlib level: 0 stores, 1 is fastest, 9 smallest
 
 // Parameter structures
 typedef struct {
@@ -29,7 +30,18 @@ typedef struct {
 
 // Image I/O functions
 Image* load_image(const char* filename);
-bool save_image(const char* filename, const Image* img);
+// Decodes into an image acquired from `pool` (which may be NULL) in the given
+// layout and border, so a warm pool allocates nothing frame-sized. If luma is
+// not NULL, *luma receives the image's one-channel luma (see create_grayscale),
+// computed in the same pass over the decoded samples and drawn from the same
+// pool with the same geometry.
+Image* load_image_pooled(const char* filename, ImagePool* pool, ImageLayout layout, int border,
+                         Image** luma);
+bool save_image(const char* filename, const Image* img);  // At PNG_DEFAULT_LEVEL
+// Thread-safe, so several frames can be encoded at once
+bool save_image_png(const char* filename, const Image* img, int level);
+// One-channel BT.601 luma of an RGB or RGBA image in the same layout and
+// border; gray images keep their first channel
 Image* create_grayscale(const Image* color_img);
 
 // Parameter handling
@@ -1,9 +1,19 @@
 #include "video_denoising.h"
+#include "utils.h"
+#include "profiler.h"
+#include "frame_pool.h"
+#include "ica.h"
 #include <stddef.h>   // for NULL
 #include <stdlib.h>   // for malloc and free
 #include <stdio.h>    // for FILE, printf, snprintf, fopen, fclose
+#include <string.h>   // for memcpy
 
 Image* denoise_frame(FrameBuffer* buffer, const DenoisingParams* params) {
+    return denoise_buffered_frame(buffer, params, params ? params->temporal_radius : 0);
+}
+
+Image* denoise_buffered_frame(FrameBuffer* buffer, const DenoisingParams* params, int age) {
+    PROF_SCOPE(PROF_STAGE_DENOISE);
     printf("Starting denoise_frame with buffer=%p, params=%p\n", (void*)buffer, (void*)params);
     
     if (!buffer) {
@@ -29,112 +39,257 @@ Image* denoise_frame(FrameBuffer* buffer, const DenoisingParams* params) {
         return NULL;
     }
     
-    int center_idx = buffer->current - params->temporal_radius;
-    if (center_idx < 0) center_idx += buffer->capacity;
-    
-    printf("Allocating aligned_frames array for %d frames\n", 2*params->temporal_radius + 1);
-    Image** aligned_frames = malloc(sizeof(Image*) * (2*params->temporal_radius + 1));
-    if (!aligned_frames) {
-        printf("Failed to allocate aligned_frames array\n");
+    if (age < 0 || age >= buffer->size) {
+        printf("Error: No buffered frame %d frames before the newest (buffer size %d)\n",
+               age, buffer->size);
         return NULL;
     }
     
-    for (int i = 0; i < 2*params->temporal_radius + 1; i++) {
-        aligned_frames[i] = NULL;
-    }
+    // buffer->current is one past the newest frame, so the center sits `age` before that
+    int center_idx = (buffer->current - 1 - age + 2 * buffer->capacity) % buffer->capacity;
     
-    printf("Setting center frame at index %d\n", params->temporal_radius);
-    aligned_frames[params->temporal_radius] = buffer->frames[center_idx];
-    if (!aligned_frames[params->temporal_radius]) {
-        printf("Center frame is NULL\n");
-        free(aligned_frames);
+    // Near either end of the sequence the window only covers the neighbors
+    // that exist, so every frame gets an output
+    int before = buffer->size - 1 - age < params->temporal_radius ? buffer->size - 1 - age
+                                                                   : params->temporal_radius;
+    int after = age < params->temporal_radius ? age : params->temporal_radius;
+    
+    // Per-call temporaries come from the block matching arena, if there is one
+    FrameArena* arena = buffer->pyramid_params ? buffer->pyramid_params->arena : NULL;
+    FrameArenaMark mark = frame_arena_mark(arena);
+    
+    // Each frame in the window and its flow to the center (none for the center
+    // itself); the frames are warped straight into the average at the end
+    int num_frames = before + after + 1;
+    printf("Allocating frame and flow arrays for %d frames\n", num_frames);
+    Image** sources = frame_arena_alloc(arena, sizeof(Image*) * num_frames);
+    AlignmentMap** flows = frame_arena_alloc(arena, sizeof(AlignmentMap*) * num_frames);
+    if (!sources || !flows) {
+        printf("Failed to allocate frame and flow arrays\n");
+        frame_arena_free(arena, flows);
+        frame_arena_free(arena, sources);
+        frame_arena_release(arena, mark);
         return NULL;
     }
     
-    // Initialize block matching parameters
-    BlockMatchingParams* bm_params = create_block_matching_params(1);
-    if (!bm_params) {
-        printf("Failed to create block matching params\n");
-        free(aligned_frames);
-        return NULL;
+    for (int i = 0; i < num_frames; i++) {
+        sources[i] = NULL;
+        flows[i] = NULL;
     }
     
-    printf("Setting block matching parameters: block_size=%d, search_radius=%d\n", 
-           params->block_size, params->search_radius);
-    if (params->block_size <= 0 || params->search_radius <= 0) {
-        printf("Error: Invalid block matching parameters\n");
-        free_block_matching_params(bm_params);
-        free(aligned_frames);
+    printf("Setting center frame at index %d\n", before);
+    sources[before] = buffer->frames[center_idx];
+    if (!sources[before]) {
+        printf("Center frame is NULL\n");
+        frame_arena_free(arena, flows);
+        frame_arena_free(arena, sources);
+        frame_arena_release(arena, mark);
         return NULL;
     }
-    bm_params->tile_sizes[0] = params->block_size;
-    bm_params->search_radii[0] = params->search_radius;
     
-    // Align neighboring frames to center frame
-    for (int offset = -params->temporal_radius; offset <= params->temporal_radius; offset++) {
-        if (offset == 0) continue;
-        
-        printf("Processing frame offset %d\n", offset);
-        int frame_idx = (center_idx + offset + buffer->capacity) % buffer->capacity;
-        printf("Accessing frame at buffer index %d\n", frame_idx);
-        
-        if (!buffer->frames[frame_idx]) {
-            printf("Frame at index %d is NULL\n", frame_idx);
-            free_block_matching_params(bm_params);
-            free(aligned_frames);
+    // Use the buffer's block matching parameters when its pyramid cache is on
+    BlockMatchingParams* owned_bm_params = NULL;
+    const BlockMatchingParams* bm_params = buffer->pyramid_params;
+    if (!bm_params) {
+        owned_bm_params = create_denoising_bm_params(params);
+        if (!owned_bm_params) {
+            printf("Failed to create block matching params\n");
+            frame_arena_free(arena, flows);
+            frame_arena_free(arena, sources);
+            frame_arena_release(arena, mark);
             return NULL;
         }
-        
-        // Compute optical flow
+        bm_params = owned_bm_params;
+    }
+    
+    // The reference pyramid is shared by every offset; build it here only if
+    // the buffer did not cache it when the frame was inserted
+    ImagePyramid* owned_ref_pyramid = NULL;
+    const ImagePyramid* ref_pyramid = buffer->pyramids[center_idx];
+    if (!ref_pyramid) {
         printf("Initializing block matching for reference frame\n");
-        ImagePyramid* ref_pyramid = init_block_matching(buffer->frames[center_idx], bm_params);
-        if (!ref_pyramid) {
+        owned_ref_pyramid = init_block_matching(frame_buffer_alignment_image(buffer, center_idx), bm_params);
+        if (!owned_ref_pyramid) {
             printf("Failed to initialize block matching\n");
-            free_block_matching_params(bm_params);
-            free(aligned_frames);
+            free_block_matching_params(owned_bm_params);
+            frame_arena_free(arena, flows);
+            frame_arena_free(arena, sources);
+            frame_arena_release(arena, mark);
             return NULL;
         }
-        
-        AlignmentMap* flow = align_image_block_matching(buffer->frames[frame_idx], ref_pyramid, bm_params);
-        if (!flow) {
-            free_image_pyramid(ref_pyramid);
-            free_block_matching_params(bm_params);
-            free(aligned_frames);
-            return NULL;
+        ref_pyramid = owned_ref_pyramid;
+    }
+    
+    // ICA refines every flow against the center's gradients, taken once per
+    // window on the same plane the search ran on
+    ICAParams ica_params = {
+        .sigma_blur = 0.0f,
+        .num_iterations = params->ica_iterations,
+        .tile_size = params->block_size,
+        .blur_engine = NULL,
+        .thread_pool = bm_params->thread_pool,
+    };
+    ImageGradients* ica_grads = NULL;
+    HessianMatrix* ica_hessian = NULL;
+    if (params->ica_iterations > 0) {
+        ica_grads = init_ica(frame_buffer_alignment_image(buffer, center_idx), &ica_params);
+        ica_hessian = ica_grads ? compute_hessian(ica_grads, params->block_size) : NULL;
+        if (!ica_hessian) {
+            printf("ICA unavailable for this window; keeping the block matching flows\n");
         }
+    }
+    
+    // Align neighboring frames to center frame, walking outwards on each side
+    // so the cached flow chain can be extended one link at a time
+    bool failed = false;
+    for (int direction = -1; direction <= 1 && !failed; direction += 2) {
+        AlignmentMap* chain = NULL;
+        bool chain_valid = buffer->flow_cache;
         
-        // Warp frame
-        Image* warped = warp_image(buffer->frames[frame_idx], flow);
-        if (!warped) {
-            free_alignment_map(flow);
-            free_image_pyramid(ref_pyramid);
-            free_block_matching_params(bm_params);
-            free(aligned_frames);
-            return NULL;
+        int steps = direction < 0 ? before : after;
+        for (int step = 1; step <= steps; step++) {
+            int offset = direction * step;
+            printf("Processing frame offset %d\n", offset);
+            int frame_idx = (center_idx + offset + buffer->capacity) % buffer->capacity;
+            printf("Accessing frame at buffer index %d\n", frame_idx);
+            
+            if (!buffer->frames[frame_idx]) {
+                printf("Frame at index %d is NULL\n", frame_idx);
+                failed = true;
+                break;
+            }
+            
+            // Extend the chain by the cached flow from the previous frame on this side
+            if (chain_valid) {
+                int link_idx = (frame_idx - direction + buffer->capacity) % buffer->capacity;
+                const AlignmentMap* link = direction > 0 ? buffer->forward_flows[link_idx]
+                                                         : buffer->backward_flows[link_idx];
+                if (!link || !buffer->pyramids[frame_idx]) {
+                    chain_valid = false;
+                } else if (!chain) {
+                    chain = create_alignment_map(link->height, link->width);
+                    if (chain) {
+                        memcpy(chain->data, link->data, sizeof(Alignment) * link->height * link->width);
+                    }
+                    chain_valid = chain != NULL;
+                } else {
+                    chain_valid = compose_alignments(chain, link, bm_params->tile_sizes[0]);
+                }
+            }
+            
+            // Compute optical flow: refine the composed chain if there is one,
+            // otherwise search, reusing the alternate's cached pyramid if any
+            AlignmentMap* flow = NULL;
+            if (chain_valid) {
+                flow = create_alignment_map(chain->height, chain->width);
+                if (flow) {
+                    memcpy(flow->data, chain->data, sizeof(Alignment) * chain->height * chain->width);
+                    if (params->flow_refine_radius > 0 &&
+                        !refine_alignments_block_matching(buffer->pyramids[frame_idx], ref_pyramid,
+                                                          bm_params, params->flow_refine_radius, flow)) {
+                        free_alignment_map(flow);
+                        flow = NULL;
+                    }
+                }
+            } else {
+                const ImagePyramid* alt_pyramid = buffer->pyramids[frame_idx];
+                ImagePyramid* owned_alt_pyramid = NULL;
+                if (!alt_pyramid) {
+                    owned_alt_pyramid = init_block_matching(frame_buffer_alignment_image(buffer, frame_idx),
+                                                            bm_params);
+                    alt_pyramid = owned_alt_pyramid;
+                }
+                
+                // Under steady motion, this offset's flow changes little from the last window
+                AlignmentPrior prior = {
+                    .alignments = buffer->window_flows[params->temporal_radius + offset],
+                    .initial_guess = false,
+                    .candidate = true,
+                    .confident_radius = params->prior_radius,
+                };
+                if (alt_pyramid) {
+                    flow = align_pyramids_block_matching_with_prior(alt_pyramid, ref_pyramid, bm_params,
+                                                                    params->temporal_prior ? &prior : NULL);
+                }
+                free_image_pyramid(owned_alt_pyramid);
+            }
+            if (!flow) {
+                failed = true;
+                break;
+            }
+            
+            // Sub-pixel refinement; a failed refinement keeps the searched flow
+            if (ica_hessian) {
+                AlignmentMap* refined = refine_alignment_ica(frame_buffer_alignment_image(buffer, center_idx),
+                                                             frame_buffer_alignment_image(buffer, frame_idx),
+                                                             ica_grads, ica_hessian, flow, &ica_params);
+                if (refined) {
+                    free_alignment_map(flow);
+                    flow = refined;
+                }
+            }
+            
+            // The last window's flows stay with the buffer for the next prior
+            if (params->temporal_prior) {
+                free_alignment_map(buffer->window_flows[params->temporal_radius + offset]);
+                buffer->window_flows[params->temporal_radius + offset] = flow;
+            }
+            sources[before + offset] = buffer->frames[frame_idx];
+            flows[before + offset] = flow;
         }
-        
-        aligned_frames[params->temporal_radius + offset] = warped;
-        
-        // Cleanup
-        free_image_pyramid(ref_pyramid);
-        free_alignment_map(flow);
+        free_alignment_map(chain);
     }
     
-    // Perform temporal averaging
-    Image* denoised = temporal_average(aligned_frames, 2*params->temporal_radius + 1);
+    // Warp every neighbor into the temporal average in one pass
+    Image* denoised = NULL;
+    if (!failed) {
+        denoised = warp_and_average(sources, flows, num_frames, bm_params->thread_pool);
+    }
     
     // Cleanup
-    free_block_matching_params(bm_params);
-    for (int i = 0; i < 2*params->temporal_radius + 1; i++) {
-        if (i != params->temporal_radius) { // Don't free center frame
-            free_image(aligned_frames[i]);
+    free_hessian_matrix(ica_hessian);
+    free_image_gradients(ica_grads);
+    free_image_pyramid(owned_ref_pyramid);
+    free_block_matching_params(owned_bm_params);
+    if (!params->temporal_prior) {
+        for (int i = 0; i < num_frames; i++) {
+            free_alignment_map(flows[i]);
         }
     }
-    free(aligned_frames);
+    frame_arena_free(arena, flows);
+    frame_arena_free(arena, sources);
+    frame_arena_release(arena, mark);
     
     return denoised;
 } 
 
+BlockMatchingParams* create_denoising_bm_params(const DenoisingParams* params) {
+    if (!params || params->block_size <= 0 || params->search_radius <= 0) {
+        printf("Error: Invalid block matching parameters\n");
+        return NULL;
+    }
+    
+    BlockMatchingParams* bm_params = create_block_matching_params(1);
+    if (!bm_params) return NULL;
+    
+    printf("Setting block matching parameters: block_size=%d, search_radius=%d\n", 
+           params->block_size, params->search_radius);
+    bm_params->factors[0] = 1;
+    bm_params->tile_sizes[0] = params->block_size;
+    bm_params->search_radii[0] = params->search_radius;
+    bm_params->distances[0] = 0;  // L1
+    bm_params->pixel_format = params->pixel_format;
+    bm_params->search_strategy = params->search_strategy;
+    bm_params->subpixel = params->subpixel;
+    if (!set_block_matching_threads(bm_params, params->num_threads)) {
+        printf("Failed to start %d block matching threads\n", params->num_threads);
+        free_block_matching_params(bm_params);
+        return NULL;
+    }
+    
+    return bm_params;
+}
+
 static char* current_frame_path = NULL;
 static int frame_counter = 0;
 
@@ -9,11 +9,35 @@ typedef struct {
     float noise_level;      // Estimated noise level for better averaging
     int block_size;         // Block size for motion estimation
     int search_radius;      // Search radius for motion estimation
+    int num_threads;        // Threads for block matching (1 runs serially)
+    int flow_refine_radius; // Residual search around flows composed from the buffer's flow cache
+    bool temporal_prior;    // Seed each search with the previous window's flow for the same offset
+    int prior_radius;       // Search radius where that prior is coherent (0 keeps search_radius)
+    PixelFormat pixel_format; // Sample format searched by block matching (float keeps pixel_t)
+    SearchStrategy search_strategy; // How block matching walks the search window
+    bool subpixel;          // Quadratic sub-pixel fit of each block matching minimum
+    int ica_iterations;     // ICA refinement of each flow on the alignment planes (0 skips it)
 } DenoisingParams;
 
-// Main denoising function
+// Main denoising function. Uses the buffer's pyramid parameters and cached
+// pyramids when set, otherwise builds its own for this call. With the buffer's
+// flow cache on, neighbors are aligned by composing cached adjacent-frame flows
+// and refining them within flow_refine_radius instead of a full search. With
+// temporal_prior, searches start from the previous call's flows, which assumes
+// consecutive calls see windows one frame apart. ICA needs one-channel
+// alignment images, so color frames need an alignment plane other than
+// ALIGN_PLANE_ALL.
 Image* denoise_frame(FrameBuffer* buffer, const DenoisingParams* params);
 
+// Same for the frame `age` frames older than the newest in the buffer, with
+// the window cut down to the neighbors the buffer holds within temporal_radius.
+// denoise_frame is age temporal_radius; smaller ages flush the end of a
+// sequence, and a buffer not yet full covers its start.
+Image* denoise_buffered_frame(FrameBuffer* buffer, const DenoisingParams* params, int age);
+
+// Single-level block matching parameters matching the denoising settings
+BlockMatchingParams* create_denoising_bm_params(const DenoisingParams* params);
+
 // Add this with other function declarations
 Image* load_next_frame(const char* input_pattern, int frame_idx);
 
@@ -0,0 +1,417 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "video_io.h"
+#include "frame_pool.h"
+#include "profiler.h"
+#include "pixel_convert.h"
+
+// stdio buffer for the stream; whole frames are read and written in one call
+#define VIDEO_IO_BUFFER (1 << 20)
+#define Y4M_MAGIC "YUV4MPEG2"
+// Frames of a mapped file asked for ahead of the one being read
+#define VIDEO_READ_AHEAD_FRAMES 4
+
+struct VideoReader {
+    FILE* file;
+    bool owns_file;
+    VideoFormat format;
+    uint8_t* bytes;         // One frame of packed planes, reused for every frame
+    size_t frame_bytes;
+    const uint8_t* mapping; // Whole file when memory-mapped, else NULL
+    size_t mapping_size;
+    size_t next_offset;     // Of the next frame in the mapping
+    bool views;             // Frames are views over the mapping
+    ImagePool* pool;
+    ImageLayout layout;
+    int border;
+};
+
+struct VideoWriter {
+    FILE* file;
+    VideoFormat format;
+    uint8_t* bytes;
+    size_t frame_bytes;
+    bool failed;
+};
+
+bool is_video_stream_path(const char* path) {
+    if (!path) return false;
+    const char* ext = strrchr(path, '.');
+    return strcmp(path, "-") == 0 || (ext && (strcmp(ext, ".yuv") == 0 || strcmp(ext, ".y4m") == 0));
+}
+
+VideoContainer video_container_for_path(const char* path, VideoContainer fallback) {
+    const char* ext = path ? strrchr(path, '.') : NULL;
+    if (ext && strcmp(ext, ".yuv") == 0) return VIDEO_CONTAINER_RAW;
+    if (ext && strcmp(ext, ".y4m") == 0) return VIDEO_CONTAINER_Y4M;
+    return fallback;
+}
+
+static int video_planes(const VideoFormat* format) {
+    return format->chroma == VIDEO_CHROMA_MONO ? 1 : 3;
+}
+
+static void plane_size(const VideoFormat* format, int plane, int* width, int* height) {
+    bool subsampled = plane > 0 && format->chroma == VIDEO_CHROMA_420;
+    *width = subsampled ? (format->width + 1) / 2 : format->width;
+    *height = subsampled ? (format->height + 1) / 2 : format->height;
+}
+
+static size_t frame_size(const VideoFormat* format) {
+    size_t samples = 0;
+    for (int p = 0; p < video_planes(format); p++) {
+        int width, height;
+        plane_size(format, p, &width, &height);
+        samples += (size_t)width * height;
+    }
+    return samples * (format->sample_type == VIDEO_SAMPLE_F32 ? sizeof(float) : 1);
+}
+
+// Maps a regular file for reading, or leaves the reader on stdio
+static void map_video_file(VideoReader* reader) {
+    struct stat st;
+    if (fstat(fileno(reader->file), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) return;
+    void* mapping = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(reader->file), 0);
+    if (mapping == MAP_FAILED) return;
+    madvise(mapping, (size_t)st.st_size, MADV_SEQUENTIAL);
+    reader->mapping = (const uint8_t*)mapping;
+    reader->mapping_size = (size_t)st.st_size;
+
+    // Float frames that need no conversion are used in place. The view's
+    // sample count tells whether the layout pads its rows.
+    const VideoFormat* format = &reader->format;
+    int planes = video_planes(format);
+    if (format->sample_type == VIDEO_SAMPLE_F32 && format->chroma != VIDEO_CHROMA_420 &&
+        (planes == 1 || reader->layout == IMAGE_LAYOUT_PLANAR)) {
+        Image* probe = create_image_view((const pixel_t*)reader->mapping, format->height, format->width, planes,
+                                         reader->layout, NULL);
+        reader->views = probe && probe->num_samples * sizeof(pixel_t) == reader->frame_bytes;
+        free_image(probe);
+    }
+}
+
+// Reads the rest of a header line, returning false at end of file. Lines
+// longer than the buffer are truncated.
+static bool read_header_line(FILE* file, char* line, size_t size) {
+    if (!fgets(line, (int)size, file)) return false;
+    size_t len = strlen(line);
+    if (len > 0 && line[len - 1] == '\n') {
+        line[len - 1] = '\0';
+    } else {
+        int ch;
+        while ((ch = getc(file)) != EOF && ch != '\n') {}
+    }
+    return true;
+}
+
+static bool parse_y4m_header(FILE* file, VideoFormat* format) {
+    char line[1024];
+    if (!read_header_line(file, line, sizeof(line)) ||
+        strncmp(line, Y4M_MAGIC, strlen(Y4M_MAGIC)) != 0) {
+        fprintf(stderr, "Error: missing YUV4MPEG2 stream header\n");
+        return false;
+    }
+
+    format->width = 0;
+    format->height = 0;
+    format->chroma = VIDEO_CHROMA_420;  // The default when there is no C tag
+    format->y4m_params[0] = '\0';
+    size_t params_len = 0;
+    for (char* tag = strtok(line + strlen(Y4M_MAGIC), " "); tag; tag = strtok(NULL, " ")) {
+        if (tag[0] == 'W') {
+            format->width = atoi(tag + 1);
+            continue;
+        }
+        if (tag[0] == 'H') {
+            format->height = atoi(tag + 1);
+            continue;
+        }
+        if (tag[0] == 'C') {
+            const char* c = tag + 1;
+            if (strcmp(c, "mono") == 0) {
+                format->chroma = VIDEO_CHROMA_MONO;
+            } else if (strcmp(c, "444") == 0) {
+                format->chroma = VIDEO_CHROMA_444;
+            } else if (strcmp(c, "420") == 0 || strcmp(c, "420jpeg") == 0 || strcmp(c, "420paldv") == 0 ||
+                       strcmp(c, "420mpeg2") == 0) {
+                format->chroma = VIDEO_CHROMA_420;
+            } else {
+                fprintf(stderr, "Error: unsupported Y4M colorspace %s (8-bit mono, 420 or 444 only)\n", c);
+                return false;
+            }
+        }
+        // Everything but the size goes through to the output unchanged
+        size_t len = strlen(tag);
+        if (params_len + len + 2 > sizeof(format->y4m_params)) continue;
+        format->y4m_params[params_len++] = ' ';
+        memcpy(format->y4m_params + params_len, tag, len + 1);
+        params_len += len;
+    }
+
+    if (format->width <= 0 || format->height <= 0) {
+        fprintf(stderr, "Error: Y4M header has no valid frame size\n");
+        return false;
+    }
+    return true;
+}
+
+VideoReader* create_video_reader(const char* path, const VideoFormat* format, ImagePool* pool,
+                                 ImageLayout layout, int border) {
+    if (!path || !format) return NULL;
+
+    VideoReader* reader = (VideoReader*)calloc(1, sizeof(VideoReader));
+    if (!reader) return NULL;
+    reader->format = *format;
+    reader->pool = pool;
+    reader->layout = layout;
+    reader->border = border;
+
+    reader->owns_file = strcmp(path, "-") != 0;
+    reader->file = reader->owns_file ? fopen(path, "rb") : stdin;
+    if (!reader->file) {
+        fprintf(stderr, "Error: cannot open video %s\n", path);
+        free(reader);
+        return NULL;
+    }
+    setvbuf(reader->file, NULL, _IOFBF, VIDEO_IO_BUFFER);
+
+    if (format->container == VIDEO_CONTAINER_Y4M) {
+        reader->format.sample_type = VIDEO_SAMPLE_U8;
+        if (!parse_y4m_header(reader->file, &reader->format)) {
+            free_video_reader(reader);
+            return NULL;
+        }
+    }
+    if (reader->format.width <= 0 || reader->format.height <= 0) {
+        fprintf(stderr, "Error: raw video %s needs a frame size\n", path);
+        free_video_reader(reader);
+        return NULL;
+    }
+
+    reader->frame_bytes = frame_size(&reader->format);
+    if (reader->owns_file && format->container == VIDEO_CONTAINER_RAW) map_video_file(reader);
+    if (!reader->mapping) {
+        reader->bytes = (uint8_t*)malloc(reader->frame_bytes);
+        if (!reader->bytes) {
+            free_video_reader(reader);
+            return NULL;
+        }
+    }
+    return reader;
+}
+
+void free_video_reader(VideoReader* reader) {
+    if (!reader) return;
+    if (reader->mapping) munmap((void*)reader->mapping, reader->mapping_size);
+    if (reader->owns_file) fclose(reader->file);
+    free(reader->bytes);
+    free(reader);
+}
+
+const VideoFormat* video_reader_format(const VideoReader* reader) {
+    return reader ? &reader->format : NULL;
+}
+
+Image* read_video_frame(VideoReader* reader) {
+    if (!reader) return NULL;
+    PROF_SCOPE(PROF_STAGE_LOAD);
+    const VideoFormat* format = &reader->format;
+
+    const uint8_t* frame = reader->bytes;
+    if (reader->mapping) {
+        size_t offset = reader->next_offset;
+        if (offset >= reader->mapping_size) return NULL;
+        if (reader->mapping_size - offset < reader->frame_bytes) {
+            fprintf(stderr, "Error: truncated video frame (%zu of %zu bytes)\n", reader->mapping_size - offset,
+                    reader->frame_bytes);
+            return NULL;
+        }
+        frame = reader->mapping + offset;
+        reader->next_offset += reader->frame_bytes;
+
+        // Start paging in the frames after this one
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t ahead = reader->next_offset / page * page;
+        size_t ahead_end = reader->next_offset + VIDEO_READ_AHEAD_FRAMES * reader->frame_bytes;
+        if (ahead_end > reader->mapping_size) ahead_end = reader->mapping_size;
+        if (ahead < ahead_end) madvise((void*)(reader->mapping + ahead), ahead_end - ahead, MADV_WILLNEED);
+    } else {
+        if (format->container == VIDEO_CONTAINER_Y4M) {
+            char line[256];
+            if (!read_header_line(reader->file, line, sizeof(line))) return NULL;
+            if (strncmp(line, "FRAME", 5) != 0) {
+                fprintf(stderr, "Error: expected a Y4M FRAME header\n");
+                return NULL;
+            }
+        }
+        size_t got = fread(reader->bytes, 1, reader->frame_bytes, reader->file);
+        if (got != reader->frame_bytes) {
+            if (got > 0 || format->container == VIDEO_CONTAINER_Y4M) {
+                fprintf(stderr, "Error: truncated video frame (%zu of %zu bytes)\n", got, reader->frame_bytes);
+            }
+            return NULL;
+        }
+    }
+
+    int planes = video_planes(format);
+    if (reader->views) {
+        Image* view = create_image_view((const pixel_t*)frame, format->height, format->width, planes,
+                                        reader->layout, reader->pool);
+        if (view) PROF_COUNT(PROF_COUNTER_PIXELS_LOADED, view->width * view->height);
+        return view;
+    }
+
+    Image* img = image_pool_acquire(reader->pool, format->height, format->width, planes, reader->layout,
+                                    reader->border);
+    if (!img) return NULL;
+
+    // Channel c of pixel (x, y) is at image_plane(img, c) + y * pitch + x * pixel_stride
+    int pixel_stride = img->layout == IMAGE_LAYOUT_PLANAR ? 1 : img->channels;
+    size_t sample_size = format->sample_type == VIDEO_SAMPLE_F32 ? sizeof(float) : 1;
+    const uint8_t* in_plane = frame;
+    for (int p = 0; p < planes; p++) {
+        int plane_width, plane_height;
+        plane_size(format, p, &plane_width, &plane_height);
+        int shift = p > 0 && format->chroma == VIDEO_CHROMA_420 ? 1 : 0;
+        for (int y = 0; y < img->height; y++) {
+            const uint8_t* in = in_plane + (size_t)(y >> shift) * plane_width * sample_size;
+            pixel_t* out = image_plane(img, p) + (size_t)y * img->pitch;
+            if (format->sample_type == VIDEO_SAMPLE_F32) {
+                const float* in_f32 = (const float*)in;
+                for (int x = 0; x < img->width; x++) {
+                    out[(size_t)x * pixel_stride] = in_f32[x >> shift];
+                }
+            } else if (shift == 0 && pixel_stride == 1) {
+                convert_u8_to_float(in, out, img->width);
+            } else {
+                for (int x = 0; x < img->width; x++) {
+                    out[(size_t)x * pixel_stride] = (float)in[x >> shift] * (1.0f / 255.0f);
+                }
+            }
+        }
+        in_plane += (size_t)plane_width * plane_height * sample_size;
+    }
+    extend_image_border(img);
+
+    PROF_COUNT(PROF_COUNTER_PIXELS_LOADED, img->width * img->height);
+    return img;
+}
+
+VideoWriter* create_video_writer(const char* path, const VideoFormat* format) {
+    if (!path || !format || format->width <= 0 || format->height <= 0) return NULL;
+
+    VideoWriter* writer = (VideoWriter*)calloc(1, sizeof(VideoWriter));
+    if (!writer) return NULL;
+    writer->format = *format;
+    if (format->container == VIDEO_CONTAINER_Y4M) writer->format.sample_type = VIDEO_SAMPLE_U8;
+
+    if (strcmp(path, "-") == 0) {
+        // Progress messages are printed to stdout, so they move to stderr
+        fflush(stdout);
+        int fd = dup(STDOUT_FILENO);
+        if (fd >= 0 && dup2(STDERR_FILENO, STDOUT_FILENO) >= 0) writer->file = fdopen(fd, "wb");
+    } else {
+        writer->file = fopen(path, "wb");
+    }
+    if (!writer->file) {
+        fprintf(stderr, "Error: cannot open video %s for writing\n", path);
+        free(writer);
+        return NULL;
+    }
+    setvbuf(writer->file, NULL, _IOFBF, VIDEO_IO_BUFFER);
+
+    writer->frame_bytes = frame_size(&writer->format);
+    writer->bytes = (uint8_t*)malloc(writer->frame_bytes);
+    if (!writer->bytes) {
+        free_video_writer(writer);
+        return NULL;
+    }
+
+    if (format->container == VIDEO_CONTAINER_Y4M) {
+        // Tags read from a Y4M input are kept; a raw input gets the defaults
+        const char* params = format->y4m_params;
+        static const char* chroma_tags[] = {" Cmono", " C420jpeg", " C444"};
+        fprintf(writer->file, Y4M_MAGIC " W%d H%d%s%s%s\n", format->width, format->height,
+                strstr(params, " F") ? "" : " F25:1",
+                strstr(params, " C") ? "" : chroma_tags[format->chroma], params);
+    }
+    return writer;
+}
+
+bool free_video_writer(VideoWriter* writer) {
+    if (!writer) return false;
+    bool ok = !writer->failed;
+    if (fclose(writer->file) != 0) ok = false;
+    free(writer->bytes);
+    free(writer);
+    return ok;
+}
+
+// Appends one sample in the output's sample type
+static inline uint8_t* put_sample(uint8_t* out, float val, VideoSampleType type) {
+    if (type == VIDEO_SAMPLE_F32) {
+        memcpy(out, &val, sizeof(float));
+        return out + sizeof(float);
+    }
+    val = val * 255.0f + 0.5f;
+    *out = (uint8_t)(val < 0.0f ? 0.0f : (val > 255.0f ? 255.0f : val));
+    return out + 1;
+}
+
+bool write_video_frame(VideoWriter* writer, const Image* img) {
+    if (!writer || !img) return false;
+    PROF_SCOPE(PROF_STAGE_SAVE);
+    const VideoFormat* format = &writer->format;
+    int planes = video_planes(format);
+    if (img->width != format->width || img->height != format->height || img->channels != planes) {
+        fprintf(stderr, "Error: frame does not match the output video format\n");
+        writer->failed = true;
+        return false;
+    }
+
+    int pixel_stride = img->layout == IMAGE_LAYOUT_PLANAR ? 1 : img->channels;
+    uint8_t* out = writer->bytes;
+    for (int p = 0; p < planes; p++) {
+        const pixel_t* plane = image_plane(img, p);
+        int plane_width, plane_height;
+        plane_size(format, p, &plane_width, &plane_height);
+        if (p == 0 || format->chroma != VIDEO_CHROMA_420) {
+            for (int y = 0; y < img->height; y++) {
+                const pixel_t* in = plane + (size_t)y * img->pitch;
+                for (int x = 0; x < img->width; x++) {
+                    out = put_sample(out, in[(size_t)x * pixel_stride], format->sample_type);
+                }
+            }
+            continue;
+        }
+
+        // Each subsampled chroma sample is the mean of the pixels it covers
+        for (int cy = 0; cy < plane_height; cy++) {
+            int y0 = 2 * cy;
+            int y1 = y0 + 1 < img->height ? y0 + 1 : y0;
+            const pixel_t* row0 = plane + (size_t)y0 * img->pitch;
+            const pixel_t* row1 = plane + (size_t)y1 * img->pitch;
+            for (int cx = 0; cx < plane_width; cx++) {
+                size_t x0 = (size_t)(2 * cx) * pixel_stride;
+                size_t x1 = 2 * cx + 1 < img->width ? x0 + pixel_stride : x0;
+                out = put_sample(out, 0.25f * (row0[x0] + row0[x1] + row1[x0] + row1[x1]), format->sample_type);
+            }
+        }
+    }
+
+    bool ok = true;
+    if (format->container == VIDEO_CONTAINER_Y4M && fputs("FRAME\n", writer->file) == EOF) ok = false;
+    if (ok && fwrite(writer->bytes, 1, writer->frame_bytes, writer->file) != writer->frame_bytes) ok = false;
+    if (!ok) {
+        fprintf(stderr, "Error: failed to write video frame\n");
+        writer->failed = true;
+        return false;
+    }
+    PROF_COUNT(PROF_COUNTER_PIXELS_SAVED, img->width * img->height);
+    return true;
+}
@@ -0,0 +1,71 @@
+/**
+ * @file video_io.h
+ * @brief Streaming raw YUV/gray and Y4M video input and output
+ */
+
+#ifndef VIDEO_IO_H
+#define VIDEO_IO_H
+
+#include <stdbool.h>
+#include "block_matching.h"
+
+typedef enum {
+    VIDEO_CONTAINER_RAW = 0,  // Bare planes, frame after frame
+    VIDEO_CONTAINER_Y4M       // YUV4MPEG2 stream header, then FRAME-prefixed planes
+} VideoContainer;
+
+typedef enum {
+    VIDEO_CHROMA_MONO = 0,    // Luma only
+    VIDEO_CHROMA_420,         // Chroma planes at half width and height
+    VIDEO_CHROMA_444
+} VideoChroma;
+
+typedef enum {
+    VIDEO_SAMPLE_U8 = 0,      // Bytes scaled to [0, 1]
+    VIDEO_SAMPLE_F32          // Native-endian floats in [0, 1] (raw only)
+} VideoSampleType;
+
+typedef struct {
+    VideoContainer container;
+    VideoSampleType sample_type;
+    int width;                // Given for raw input, read from the header for Y4M
+    int height;
+    VideoChroma chroma;
+    char y4m_params[256];     // Y4M header tags other than W and H, passed through to the output
+} VideoFormat;
+
+typedef struct VideoReader VideoReader;
+typedef struct VideoWriter VideoWriter;
+
+// "-" for stdin or stdout, otherwise a file name
+bool is_video_stream_path(const char* path);
+// Raw for ".yuv", Y4M for ".y4m"; `fallback` for anything else (such as "-")
+VideoContainer video_container_for_path(const char* path, VideoContainer fallback);
+
+// Frames come out with samples in [0, 1], one channel per plane (Y, U, V),
+// with 4:2:0 chroma replicated to full resolution. Images are drawn from
+// `pool` (which may be NULL) in the given layout and border.
+// For Y4M input only format->container is used; the rest is read from the header.
+//
+// Raw files are memory-mapped and read ahead sequentially. Where the file's
+// samples already have the layout of an Image (floats, no 4:2:0 chroma, and
+// rows with no padding in the given layout), frames are views straight over
+// the mapping without a border, so the reader must outlive every frame it
+// returned. Other files and stdin are read with one sequential read per
+// frame into a buffer reused across frames.
+VideoReader* create_video_reader(const char* path, const VideoFormat* format, ImagePool* pool,
+                                 ImageLayout layout, int border);
+void free_video_reader(VideoReader* reader);
+const VideoFormat* video_reader_format(const VideoReader* reader);
+// Next frame, or NULL at the end of the stream or on a read error
+Image* read_video_frame(VideoReader* reader);
+
+// Writing to stdout takes over its descriptor and points stdout at stderr,
+// so log output cannot end up in the stream.
+VideoWriter* create_video_writer(const char* path, const VideoFormat* format);
+// Flushes and closes; returns false if any write failed
+bool free_video_writer(VideoWriter* writer);
+// 8-bit samples are rounded and clamped; 4:2:0 chroma is averaged over 2x2 pixels
+bool write_video_frame(VideoWriter* writer, const Image* img);
+
+#endif // VIDEO_IO_H
@@ -1,97 +1,242 @@
 #include "warp.h"
+#include "profiler.h"
+#include "frame_pool.h"
+#include "utils.h"
 #include <stdlib.h>
+#include <stdio.h>
 #include <math.h>
 
+// Forward-warp pixels [x_begin, x_end) of row y of src into the same row of
+// out, an image of the same geometry, either storing or adding the result
+static void warp_span(const Image* src, const AlignmentMap* flow, int y, int x_begin, int x_end,
+                      Image* out, bool accumulate) {
+    // Channel c of pixel (x, y) is at c * channel_stride + y * pitch + x * pixel_stride
+    int pixel_stride = src->layout == IMAGE_LAYOUT_PLANAR ? 1 : src->channels;
+    size_t channel_stride = src->channel_stride;
+    int pitch = src->pitch;
+    pixel_t* out_row = &out->data[(size_t)y * pitch];
+
+    // Without a flow the frame is already aligned. A frame smaller than one
+    // tile has an empty flow, with no vector to move it by.
+    if (!flow || flow->width == 0 || flow->height == 0) {
+        const pixel_t* in_row = &src->data[(size_t)y * pitch];
+        for (int c = 0; c < src->channels; c++) {
+            for (int x = x_begin; x < x_end; x++) {
+                size_t i = c * channel_stride + (size_t)x * pixel_stride;
+                out_row[i] = accumulate ? out_row[i] + in_row[i] : in_row[i];
+            }
+        }
+        return;
+    }
+
+    // Sources outside the image take the nearest edge sample. Clamped to the
+    // last row or column, the bilinear footprint still reads one pixel past
+    // it at zero weight: from the border if there is one, else clamped too.
+    float max_x = (float)(src->width - 1);
+    float max_y = (float)(src->height - 1);
+    bool guarded = src->border >= 1;
+    const Alignment* flow_row = &flow->data[(y * flow->height / src->height) * flow->width];
+
+    for (int x = x_begin; x < x_end; x++) {
+        const Alignment* a = &flow_row[x * flow->width / src->width];
+        float fx = fminf(fmaxf(x + a->x, 0.0f), max_x);
+        float fy = fminf(fmaxf(y + a->y, 0.0f), max_y);
+
+        // Bilinear interpolation
+        int x0 = (int)fx;
+        int y0 = (int)fy;
+        float wx = fx - x0;
+        float wy = fy - y0;
+        int step_x = pixel_stride;
+        int step_y = pitch;
+        if (!guarded) {
+            if (x0 == src->width - 1) step_x = 0;
+            if (y0 == src->height - 1) step_y = 0;
+        }
+
+        const pixel_t* in = &src->data[(size_t)y0 * pitch + (size_t)x0 * pixel_stride];
+        pixel_t* dst = &out_row[(size_t)x * pixel_stride];
+        for (int c = 0; c < src->channels; c++) {
+            const pixel_t* p = in + c * channel_stride;
+            float val =
+                (1-wx)*(1-wy) * p[0] +
+                wx*(1-wy) * p[step_x] +
+                (1-wx)*wy * p[step_y] +
+                wx*wy * p[step_y + step_x];
+
+            dst[c * channel_stride] = accumulate ? dst[c * channel_stride] + val : val;
+        }
+    }
+}
+
 Image* warp_image(const Image* src, const AlignmentMap* flow) {
     if (!src || !flow) return NULL;
+    PROF_SCOPE(PROF_STAGE_WARP_MERGE);
     
-    Image* warped = create_image(src->height, src->width, src->channels);
+    Image* warped = image_pool_acquire(src->pool, src->height, src->width, src->channels, src->layout,
+                                       src->border);
     if (!warped) return NULL;
 
-    // Initialize with zeros
-    for (int i = 0; i < src->height * src->width * src->channels; i++) {
-        warped->data[i] = 0.0f;
-    }
-
     // Forward warping with bilinear interpolation
     for (int y = 0; y < src->height; y++) {
-        for (int x = 0; x < src->width; x++) {
-            // Get flow vector
-            int flow_idx = (y * flow->width / src->height) * flow->width + 
-                          (x * flow->width / src->width);
-            float fx = x + flow->data[flow_idx].x;
-            float fy = y + flow->data[flow_idx].y;
-            
-            // Check bounds
-            if (fx < 0 || fx >= src->width - 1 || fy < 0 || fy >= src->height - 1)
-                continue;
-            
-            // Bilinear interpolation
-            int x0 = (int)fx;
-            int y0 = (int)fy;
-            float wx = fx - x0;
-            float wy = fy - y0;
-            
-            for (int c = 0; c < src->channels; c++) {
-                float val = 
-                    (1-wx)*(1-wy) * src->data[(y0 * src->width + x0) * src->channels + c] +
-                    wx*(1-wy) * src->data[(y0 * src->width + (x0+1)) * src->channels + c] +
-                    (1-wx)*wy * src->data[((y0+1) * src->width + x0) * src->channels + c] +
-                    wx*wy * src->data[((y0+1) * src->width + (x0+1)) * src->channels + c];
-                
-                warped->data[(y * warped->width + x) * warped->channels + c] = val;
-            }
-        }
+        warp_span(src, flow, y, 0, src->width, warped, false);
     }
+    extend_image_border(warped);
     
     return warped;
 }
 
 Image* temporal_average(Image** aligned_frames, int num_frames) {
     if (!aligned_frames || num_frames <= 0) return NULL;
+    PROF_SCOPE(PROF_STAGE_WARP_MERGE);
     
-    Image* result = create_image(
+    // Frames are averaged sample by sample, so their buffers must line up
+    for (int f = 1; f < num_frames; f++) {
+        if (!image_same_geometry(aligned_frames[f], aligned_frames[0])) {
+            printf("Error: frames to average have different layouts or borders\n");
+            return NULL;
+        }
+    }
+
+    Image* result = image_pool_acquire(
+        aligned_frames[0]->pool,
         aligned_frames[0]->height,
         aligned_frames[0]->width,
-        aligned_frames[0]->channels
+        aligned_frames[0]->channels,
+        aligned_frames[0]->layout,
+        aligned_frames[0]->border
     );
     if (!result) return NULL;
 
-    // Compute average
-    for (int y = 0; y < result->height; y++) {
-        for (int x = 0; x < result->width; x++) {
-            for (int c = 0; c < result->channels; c++) {
-                float sum = 0.0f;
-                int valid_frames = 0;
-                
-                for (int f = 0; f < num_frames; f++) {
-                    int idx = (y * result->width + x) * result->channels + c;
-                    float val = aligned_frames[f]->data[idx];
-                    if (!isnan(val)) {
-                        sum += val;
-                        valid_frames++;
-                    }
-                }
-                
-                result->data[(y * result->width + x) * result->channels + c] = 
-                    valid_frames > 0 ? sum / valid_frames : 0.0f;
-            }
+    // Compute average over the whole buffer. Borders replicate edges, so the
+    // averaged border replicates the averaged edge. Warped frames clamp their
+    // sources, so every sample is valid.
+    size_t num_samples = image_num_samples(result);
+    for (size_t i = 0; i < num_samples; i++) {
+        float sum = 0.0f;
+        for (int f = 0; f < num_frames; f++) {
+            sum += aligned_frames[f]->buffer[i];
         }
+        result->buffer[i] = sum / num_frames;
     }
     
     return result;
 }
 
+typedef struct {
+    Image* const* frames;
+    AlignmentMap* const* flows;
+    int num_frames;
+    Image* result;
+    int tiles_x;
+} WarpAverageJob;
+
+// Each frame in turn is warped into the tile of the result, which holds the
+// running sum until it is divided by the frame count. A tile's sums and the
+// source rows it reads stay in cache across frames.
+static void warp_average_tile(void* ctx, int tile) {
+    const WarpAverageJob* job = (const WarpAverageJob*)ctx;
+    Image* result = job->result;
+    int y_begin = (tile / job->tiles_x) * WARP_AVERAGE_TILE;
+    int x_begin = (tile % job->tiles_x) * WARP_AVERAGE_TILE;
+    int y_end = y_begin + WARP_AVERAGE_TILE < result->height ? y_begin + WARP_AVERAGE_TILE : result->height;
+    int x_end = x_begin + WARP_AVERAGE_TILE < result->width ? x_begin + WARP_AVERAGE_TILE : result->width;
+
+    for (int f = 0; f < job->num_frames; f++) {
+        for (int y = y_begin; y < y_end; y++) {
+            warp_span(job->frames[f], job->flows[f], y, x_begin, x_end, result, f > 0);
+        }
+    }
+
+    int pixel_stride = result->layout == IMAGE_LAYOUT_PLANAR ? 1 : result->channels;
+    for (int c = 0; c < result->channels; c++) {
+        for (int y = y_begin; y < y_end; y++) {
+            pixel_t* row = &image_plane(result, c)[(size_t)y * result->pitch];
+            for (int x = x_begin; x < x_end; x++) {
+                row[(size_t)x * pixel_stride] /= job->num_frames;
+            }
+        }
+    }
+}
+
+Image* warp_and_average(Image* const* frames, AlignmentMap* const* flows, int num_frames,
+                        ThreadPool* pool) {
+    if (!frames || !flows || num_frames <= 0 || !frames[0]) return NULL;
+    PROF_SCOPE(PROF_STAGE_WARP_MERGE);
+
+    for (int f = 1; f < num_frames; f++) {
+        if (!frames[f] || !image_same_geometry(frames[f], frames[0])) {
+            printf("Error: frames to average have different layouts or borders\n");
+            return NULL;
+        }
+    }
+
+    const Image* first = frames[0];
+    Image* result = image_pool_acquire(first->pool, first->height, first->width, first->channels,
+                                       first->layout, first->border);
+    if (!result) return NULL;
+
+    WarpAverageJob job = {
+        .frames = frames,
+        .flows = flows,
+        .num_frames = num_frames,
+        .result = result,
+        .tiles_x = (first->width + WARP_AVERAGE_TILE - 1) / WARP_AVERAGE_TILE,
+    };
+    int tiles_y = (first->height + WARP_AVERAGE_TILE - 1) / WARP_AVERAGE_TILE;
+    thread_pool_parallel_for(pool, job.tiles_x * tiles_y, warp_average_tile, &job);
+    extend_image_border(result);
+
+    return result;
+}
+
+// One-channel copy of channel 0, in the frame's layout and border
+static Image* first_channel(const Image* frame) {
+    Image* plane = image_pool_acquire(frame->pool, frame->height, frame->width, 1, frame->layout,
+                                      frame->border);
+    if (!plane) return NULL;
+    int pixel_stride = frame->layout == IMAGE_LAYOUT_PLANAR ? 1 : frame->channels;
+    for (int y = 0; y < frame->height; y++) {
+        const pixel_t* in = frame->data + (size_t)y * frame->pitch;
+        pixel_t* out = plane->data + (size_t)y * plane->pitch;
+        for (int x = 0; x < frame->width; x++) {
+            out[x] = in[(size_t)x * pixel_stride];
+        }
+    }
+    extend_image_border(plane);
+    return plane;
+}
+
+Image* create_alignment_plane(const Image* frame, AlignmentPlane plane) {
+    if (!frame || plane == ALIGN_PLANE_ALL) return NULL;
+    return plane == ALIGN_PLANE_LUMA ? create_grayscale(frame) : first_channel(frame);
+}
+
 FrameBuffer* create_frame_buffer(int capacity) {
     FrameBuffer* buffer = malloc(sizeof(FrameBuffer));
     if (!buffer) return NULL;
     
     buffer->frames = malloc(sizeof(Image*) * capacity);
-    if (!buffer->frames) {
+    buffer->pyramids = calloc(capacity, sizeof(ImagePyramid*));
+    buffer->forward_flows = calloc(capacity, sizeof(AlignmentMap*));
+    buffer->backward_flows = calloc(capacity, sizeof(AlignmentMap*));
+    buffer->window_flows = calloc(capacity, sizeof(AlignmentMap*));
+    buffer->planes = calloc(capacity, sizeof(Image*));
+    if (!buffer->frames || !buffer->pyramids || !buffer->forward_flows || !buffer->backward_flows ||
+        !buffer->window_flows || !buffer->planes) {
+        free(buffer->planes);
+        free(buffer->frames);
+        free(buffer->pyramids);
+        free(buffer->forward_flows);
+        free(buffer->backward_flows);
+        free(buffer->window_flows);
         free(buffer);
         return NULL;
     }
     
+    buffer->pyramid_params = NULL;
+    buffer->flow_cache = false;
+    buffer->alignment_plane = ALIGN_PLANE_ALL;
     buffer->capacity = capacity;
     buffer->size = 0;
     buffer->current = 0;
@@ -100,17 +245,70 @@ FrameBuffer* create_frame_buffer(int capacity) {
 }
 
 int add_frame_to_buffer(FrameBuffer* buffer, Image* frame) {
+    return add_frame_to_buffer_with_plane(buffer, frame, NULL);
+}
+
+int add_frame_to_buffer_with_plane(FrameBuffer* buffer, Image* frame, Image* plane) {
     if (!buffer || !frame) return -1;
     
-    // Free the oldest frame if buffer is full
+    // The one-channel plane everything aligns on, computed once for the
+    // frame's stay in the buffer (one-channel frames are their own plane)
+    Image* owned_plane = NULL;
+    if (buffer->alignment_plane != ALIGN_PLANE_ALL && frame->channels > 1 && !plane) {
+        owned_plane = create_alignment_plane(frame, buffer->alignment_plane);
+        if (!owned_plane) return -1;
+    }
+    Image* aligned = plane ? plane : owned_plane;
+    if (buffer->alignment_plane == ALIGN_PLANE_ALL || frame->channels == 1) aligned = NULL;
+    
+    // Build the pyramid first so a failure leaves the buffer untouched
+    ImagePyramid* pyramid = NULL;
+    if (buffer->pyramid_params) {
+        pyramid = init_block_matching(aligned ? aligned : frame, buffer->pyramid_params);
+        if (!pyramid) {
+            free_image(owned_plane);
+            return -1;
+        }
+    }
+    // A plane that will not be aligned on is not kept
+    if (plane && !aligned) free_image(plane);
+    
+    // Flows between the newest buffered frame and this one, both ways. A
+    // failed alignment only disables the cache for windows spanning this pair.
+    AlignmentMap* forward = NULL;
+    AlignmentMap* backward = NULL;
+    int prev = (buffer->current - 1 + buffer->capacity) % buffer->capacity;
+    if (buffer->flow_cache && pyramid && buffer->size > 0 && buffer->capacity > 1 &&
+        buffer->pyramids[prev]) {
+        forward = align_pyramids_block_matching(pyramid, buffer->pyramids[prev], buffer->pyramid_params);
+        backward = align_pyramids_block_matching(buffer->pyramids[prev], pyramid, buffer->pyramid_params);
+    }
+    
+    // Free the oldest frame if buffer is full, with every flow that touches it
     if (buffer->size == buffer->capacity) {
+        int next = (buffer->current + 1) % buffer->capacity;
         free_image(buffer->frames[buffer->current]);
+        free_image(buffer->planes[buffer->current]);
+        free_image_pyramid(buffer->pyramids[buffer->current]);
+        free_alignment_map(buffer->forward_flows[buffer->current]);
+        free_alignment_map(buffer->backward_flows[buffer->current]);
+        free_alignment_map(buffer->backward_flows[next]);
+        buffer->forward_flows[buffer->current] = NULL;
+        buffer->backward_flows[buffer->current] = NULL;
+        buffer->backward_flows[next] = NULL;
     } else {
         buffer->size++;
     }
     
     // Add new frame
     buffer->frames[buffer->current] = frame;
+    buffer->planes[buffer->current] = aligned;
+    buffer->pyramids[buffer->current] = pyramid;
+    if (buffer->size > 1) {
+        free_alignment_map(buffer->forward_flows[prev]);
+        buffer->forward_flows[prev] = forward;
+    }
+    buffer->backward_flows[buffer->current] = backward;
     buffer->current = (buffer->current + 1) % buffer->capacity;
     
     return 0;
@@ -122,9 +320,60 @@ void free_frame_buffer(FrameBuffer* buffer) {
     if (buffer->frames) {
         for (int i = 0; i < buffer->size; i++) {
             free_image(buffer->frames[i]);
+            free_image(buffer->planes[i]);
+            free_image_pyramid(buffer->pyramids[i]);
         }
         free(buffer->frames);
     }
+    free(buffer->planes);
+    for (int i = 0; i < buffer->capacity; i++) {
+        free_alignment_map(buffer->forward_flows[i]);
+        free_alignment_map(buffer->backward_flows[i]);
+        free_alignment_map(buffer->window_flows[i]);
+    }
+    free(buffer->pyramids);
+    free(buffer->forward_flows);
+    free(buffer->backward_flows);
+    free(buffer->window_flows);
     
     free(buffer);
-} 
\ No newline at end of file
+}
+
+const Image* frame_buffer_alignment_image(const FrameBuffer* buffer, int slot) {
+    return buffer->planes[slot] ? buffer->planes[slot] : buffer->frames[slot];
+}
+
+void set_frame_buffer_pyramid_params(FrameBuffer* buffer, const BlockMatchingParams* params) {
+    if (buffer) buffer->pyramid_params = params;
+}
+
+void set_frame_buffer_alignment_plane(FrameBuffer* buffer, AlignmentPlane plane) {
+    if (buffer) buffer->alignment_plane = plane;
+}
+
+void set_frame_buffer_flow_cache(FrameBuffer* buffer, bool enabled) {
+    if (buffer) buffer->flow_cache = enabled;
+}
+
+bool compose_alignments(AlignmentMap* chain, const AlignmentMap* next, int tile_size) {
+    if (!chain || !next || tile_size <= 0) return false;
+    if (chain->height != next->height || chain->width != next->width) return false;
+
+    for (int ty = 0; ty < chain->height; ty++) {
+        for (int tx = 0; tx < chain->width; tx++) {
+            Alignment* a = &chain->data[ty * chain->width + tx];
+
+            // Tile of the intermediate frame that this tile's center lands in
+            int nx = (int)floorf((tx * tile_size + 0.5f * tile_size + a->x) / tile_size);
+            int ny = (int)floorf((ty * tile_size + 0.5f * tile_size + a->y) / tile_size);
+            if (nx < 0) nx = 0;
+            if (nx >= next->width) nx = next->width - 1;
+            if (ny < 0) ny = 0;
+            if (ny >= next->height) ny = next->height - 1;
+
+            a->x += next->data[ny * next->width + nx].x;
+            a->y += next->data[ny * next->width + nx].y;
+        }
+    }
+    return true;
+}
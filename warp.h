@@ -9,9 +9,39 @@ Image* warp_image(const Image* src, const AlignmentMap* flow);
 // Function to perform temporal averaging of aligned frames
 Image* temporal_average(Image** aligned_frames, int num_frames);
 
+// Side of the square tiles warp_and_average works through
+#define WARP_AVERAGE_TILE 64
+
+// Warp each frame by its flow (NULL if already aligned) and average them in
+// one pass, tile by tile, without materializing the warped frames. Same
+// result as warp_image followed by temporal_average. Frames must share
+// geometry; tiles run on `pool` if given.
+Image* warp_and_average(Image* const* frames, AlignmentMap* const* flows, int num_frames,
+                        ThreadPool* pool);
+
+// Which plane of each frame pyramids, flows and ICA refinement are computed
+// on. Flows are applied to every channel either way.
+typedef enum {
+    ALIGN_PLANE_ALL = 0,    // Every channel; tile distances sum over them
+    ALIGN_PLANE_LUMA,       // BT.601 luma of RGB(A) frames (see create_grayscale)
+    ALIGN_PLANE_FIRST       // Channel 0, e.g. Y of YUV frames
+} AlignmentPlane;
+
+// One-channel alignment plane of a frame, from the frame's pool in its layout
+// and border (NULL for ALIGN_PLANE_ALL)
+Image* create_alignment_plane(const Image* frame, AlignmentPlane plane);
+
 // Structure to hold frame buffer for denoising
 typedef struct {
     Image** frames;
+    Image** planes;             // Alignment plane per frame (NULL when the frame is aligned on itself)
+    ImagePyramid** pyramids;    // Block matching pyramid per frame (NULL if not cached)
+    const BlockMatchingParams* pyramid_params;  // Not owned; enables the pyramid cache
+    AlignmentMap** forward_flows;   // Per slot: this frame (reference) to the next newer one
+    AlignmentMap** backward_flows;  // Per slot: this frame (reference) to the next older one
+    bool flow_cache;                // Compute adjacent-pair flows as frames arrive
+    AlignmentMap** window_flows;    // Per offset from the center, the last denoised window's flows
+    AlignmentPlane alignment_plane; // What pyramids are built from
     int capacity;
     int size;
     int current;
@@ -20,6 +50,31 @@ typedef struct {
 // Frame buffer management
 FrameBuffer* create_frame_buffer(int capacity);
 int add_frame_to_buffer(FrameBuffer* buffer, Image* frame);
+// Same, with the frame's alignment plane already computed (e.g. its luma,
+// taken while decoding). On success the buffer owns both images. A NULL
+// plane is computed from the frame when the alignment plane needs one.
+int add_frame_to_buffer_with_plane(FrameBuffer* buffer, Image* frame, Image* plane);
 void free_frame_buffer(FrameBuffer* buffer);
+// What the frame in `slot` is aligned on: its plane, or the frame itself
+const Image* frame_buffer_alignment_image(const FrameBuffer* buffer, int slot);
+
+// Build each frame's pyramid once, when it enters the buffer, so every
+// alignment using it as reference or alternate shares the same pyramid.
+// Must be set before frames are added; params must outlive the buffer.
+void set_frame_buffer_pyramid_params(FrameBuffer* buffer, const BlockMatchingParams* params);
+
+// Align on one plane instead of every channel. Each frame's plane is kept
+// for its stay in the buffer. Must be set before frames are added.
+void set_frame_buffer_alignment_plane(FrameBuffer* buffer, AlignmentPlane plane);
+
+// Align each incoming frame with its predecessor in both directions, so
+// center-to-neighbor flows can be composed from the chain instead of searched.
+// Needs the pyramid cache; flows that could not be computed are left NULL.
+void set_frame_buffer_flow_cache(FrameBuffer* buffer, bool enabled);
+
+// Follow `next` from where each tile of `chain` lands and add its vector, so
+// that chain (A -> B) followed by next (B -> C) becomes A -> C. Both maps are
+// on the same tile grid of `tile_size` pixels.
+bool compose_alignments(AlignmentMap* chain, const AlignmentMap* next, int tile_size);
 
 #endif // WARP_H 
\ No newline at end of file